@@ -8,19 +8,6 @@
 
 #define LOWER_BYTE(x) ((x) & 0xFF)
 #define UPPER_BYTE(x) (((x) >> 8) & 0xFF)
-#define WRITE_STREAM(x, index)                     \
-	do {                                       \
-		stream[index] = LOWER_BYTE(x);     \
-		stream[index + 1] = UPPER_BYTE(x); \
-	} while (0)
-
-static vector<instruction> instrs;
-static unordered_map<string, size_t> labels;
-static unordered_map<string, vector<size_t> > unresolved_labels;
-
-static vector<unsigned char> stream;
-static size_t cur_index = 0;
-static size_t n_errors = 0;
 
 enum token::type get_token_type(const string &token_s)
 {
@@ -40,9 +27,70 @@ enum token::type get_token_type(const string &token_s)
 		return token::LABEL_REF;
 }
 
-static vector<string> tokenize_line_s(const string &line)
+void Assembler::reset()
+{
+	instrs.clear();
+	labels.clear();
+	macros.clear();
+	diags.clear();
+
+	obj = object{};
+	sym_lines.clear();
+	cur_index = 0;
+	macro_mode = false;
+	new_section(0, 0);
+}
+
+size_t Assembler::section_base() const
+{
+	const obj_section &sec = obj.sections[cur_sec];
+
+	return (sec.flags & SEC_ABS) ? sec.addr : 0;
+}
+
+void Assembler::new_section(uint32_t flags, uint32_t addr, uint32_t load)
+{
+	obj.sections.push_back({ flags, addr, load, {} });
+	cur_sec = obj.sections.size() - 1;
+}
+
+void Assembler::error(size_t line_no, const string &msg)
 {
-	static vector<char> separators = { ' ', '\t', ',' };
+	diags.push_back({ line_no, msg });
+}
+
+void Assembler::write_byte(size_t index, unsigned char value)
+{
+	const obj_section &sec = obj.sections[cur_sec];
+
+	if (index >= IMAGE_SIZE) {
+		error(0, "Write past end of image at " + std::to_string(index));
+		return;
+	}
+
+	if ((sec.flags & SEC_BANK) && index >= sec.addr + BANK_SIZE) {
+		error(0, "Write past end of bank window at " + std::to_string(index));
+		return;
+	}
+
+	vector<unsigned char> &data = obj.sections[cur_sec].data;
+	size_t off = index - section_base();
+
+	if (off >= data.size())
+		data.resize(off + 1);
+
+	data[off] = value;
+}
+
+void Assembler::write_stream(size_t value, size_t index)
+{
+	write_byte(index, LOWER_BYTE(value));
+	write_byte(index + 1, UPPER_BYTE(value));
+}
+
+vector<string> Assembler::tokenize_line_s(const string &line, size_t line_no)
+{
+	static const vector<char> separators = { ' ', '\t', ',' };
 	vector<string> tokens_s;
 	auto is_separator = [&](char c) {
 		for (char sep : separators) {
@@ -88,21 +136,28 @@ static vector<string> tokenize_line_s(const string &line)
 	if (!cur_token.empty())
 		tokens_s.push_back(cur_token);
 
-	if (quote_open) {
-		cerr << "Error: Unclosed quote" << endl;
-		n_errors++;
-	}
+	if (quote_open)
+		error(line_no, "Unclosed quote");
 
 	return tokens_s;
 }
 
-instruction tokenize_line(line &line, size_t line_no)
+instruction Assembler::tokenize_line(line &line, size_t line_no)
 {
 	instruction ret;
 
 	ret.line_no = line_no;
 
-	vector<string> tokens_s = tokenize_line_s(line.line);
+	if (token_cache) {
+		auto it = token_cache->find(line.line);
+		if (it != token_cache->end()) {
+			ret.tokens = it->second;
+			return ret;
+		}
+	}
+
+	size_t n_diags = diags.size();
+	vector<string> tokens_s = tokenize_line_s(line.line, line_no);
 	for (const string &token_s : tokens_s) {
 		token t;
 		t.type = get_token_type(token_s);
@@ -111,64 +166,51 @@ instruction tokenize_line(line &line, size_t line_no)
 		ret.tokens.push_back(t);
 	}
 
+	if (token_cache && diags.size() == n_diags)
+		token_cache->emplace(line.line, ret.tokens);
+
 	return ret;
 }
 
-static void resolve_label(const string &label)
+void Assembler::add_label(const string &label, size_t line_no)
 {
-	if (!labels.contains(label)) {
-		cerr << "Error: Label not found: " << label << endl;
-		n_errors++;
+	if (labels.contains(label)) {
+		error(line_no, "Duplicate label: " + label);
 		return;
 	}
 
-	if (!unresolved_labels.contains(label))
-		return;
-
-	for (size_t ref_ptr : unresolved_labels[label]) {
-		size_t ptr = labels[label];
-
-		WRITE_STREAM(ptr, ref_ptr);
-	}
+	labels[label] = obj.symbols.size();
+	obj.symbols.push_back({ label, (uint32_t)cur_sec, (uint32_t)(cur_index - section_base()) });
+	sym_lines.push_back(line_no);
 }
 
-static void attempt_resolve_label(const string &label, size_t ref_ptr)
+void Assembler::add_reloc(const string &label, size_t ref_ptr)
 {
-	if (!labels.contains(label)) {
-		/* Mark as unresolved */
-		unresolved_labels[label].push_back(ref_ptr);
-	} else {
-		/* Found */
-		size_t ptr = labels[label];
-		WRITE_STREAM(ptr, ref_ptr);
-	}
+	/* Every label reference is left for the linker to patch */
+	obj.relocs.push_back({ (uint32_t)cur_sec, (uint32_t)(ref_ptr - section_base()), label });
 }
 
-static int parse_register(const string &reg)
+int Assembler::parse_register(const string &reg, size_t line_no)
 {
-	char r1 = tolower(reg[1]);
-	r1 = tolower(r1);
 	if (reg.size() != 2) {
-		cerr << "Invalid register: " << reg << endl;
-		n_errors++;
+		error(line_no, "Invalid register: " + reg);
 		return -1;
 	}
 
-	char r = r1;
-	if (r < 'a' || r > 'd') {
-		cerr << "Invalid register: " << reg << endl;
-		n_errors++;
+	char r = tolower(reg[1]);
+	if (reg[0] != '%' || r < 'a' || r > 'd') {
+		error(line_no, "Invalid register: " + reg);
 		return -1;
 	}
 
 	return r - 'a';
 }
 
-static int parse_register_or_imm(const string &reg, long &ret)
+int Assembler::parse_register_or_imm(const string &reg, long &ret, size_t line_no)
 {
 	if (reg[0] == '%') {
-		ret = parse_register(reg);
-		return ADMODE_REG;
+		ret = parse_register(reg, line_no);
+		return ret == -1 ? -1 : ADMODE_REG;
 	} else if (isdigit(reg[0])) {
 		ret = stoul(reg);
 		return ADMODE_IMM;
@@ -181,246 +223,266 @@ static int parse_register_or_imm(const string &reg, long &ret)
 	}
 }
 
-static void parse_instruction_arith(instruction &ins)
+void Assembler::parse_instruction_arith(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 	token t2 = ins.tokens[2];
 
-	string r1 = t1.str;
-	string r2 = t2.str;
+	int r1 = parse_register(t1.str, ins.line_no);
+	int r2 = parse_register(t2.str, ins.line_no);
+
+	ins.opcode <<= 12;
+	ins.opcode |= ADMODE_REG;
+	ins.opcode |= (r1 & 0x3) << 6;
+	ins.opcode |= (r2 & 0x3) << 4;
+
+	write_stream(ins.opcode, cur_index);
+	cur_index += 2;
+}
+
+void Assembler::parse_instruction_ext(instruction &ins)
+{
+	ins.opcode = (INST_CMP << 12) | (ins.opcode & 0xF) << 8;
+
+	if (ins.tokens.size() == 3) {
+		int r1 = parse_register(ins.tokens[1].str, ins.line_no);
+		int r2 = parse_register(ins.tokens[2].str, ins.line_no);
 
-	ins.opcode = ADMODE_REG;
-	ins.opcode |= ins.opcode << 12;
-	ins.opcode |= (parse_register(r1) & 0x3) << 6;
-	ins.opcode |= (parse_register(r2) & 0x3) << 4;
+		ins.opcode |= (r1 & 0x3) << 6;
+		ins.opcode |= (r2 & 0x3) << 4;
+	}
 
-	WRITE_STREAM(ins.opcode, cur_index);
+	write_stream(ins.opcode, cur_index);
 	cur_index += 2;
 }
 
-static void parse_instruction_ld(instruction &ins)
+void Assembler::parse_instruction_ld(instruction &ins)
 {
 	/* In ST, r1 is optional IMM/REGPTR, and r2 is mandatory REG */
 	/* In LD, r1 is mandatory REG, and r2 is optional IMM/REGPTR */
 	token t1 = ins.tokens[1];
 	token t2 = ins.tokens[2];
 
-	long rx_val;
-	int rx_result = parse_register(t1.str);
+	int rx_result = parse_register(t1.str, ins.line_no);
 
 	long opt_val;
-	int opt_result = parse_register_or_imm(t2.str, opt_val);
+	int opt_result = parse_register_or_imm(t2.str, opt_val, ins.line_no);
 
 	if (opt_result == -1 || rx_result == -1) {
-		cerr << "Error on line " << ins.line_no << ": Invalid register/imm: " << t1.str << " or " << t2.str << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid register/imm: " + t1.str + " or " + t2.str);
 		return;
 	}
 
-	if (opt_result == 4) {
-		/* Label reference */
-		ins.opcode = ADMODE_IMM;
-		ins.opcode |= (rx_result & 0x3) << 6;
-		attempt_resolve_label(t2.str, cur_index + 1);
-	} else {
-		ins.opcode = opt_result;
+	ins.opcode = INST_LD << 12;
+	ins.opcode |= (rx_result & 0x3) << 6;
+
+	if (opt_result == ADMODE_REG) {
+		ins.opcode |= (opt_val & 0x3) << 4;
+		write_stream(ins.opcode, cur_index);
+		cur_index += 2;
+		return;
 	}
 
-	ins.opcode |= INST_LD << 12;
+	ins.opcode |= ADMODE_IMM;
+	write_stream(ins.opcode, cur_index);
+	write_stream(opt_val, cur_index + 2);
 
-	if (ins.opcode & ADMODE_IMM) {
-		WRITE_STREAM(ins.opcode, cur_index);
-		WRITE_STREAM(opt_val, cur_index + 2);
-		cur_index += 4;
-	} else {
-		ins.opcode |= (opt_val) << 4;
-		WRITE_STREAM(ins.opcode, cur_index);
-		cur_index += 2;
+	if (opt_result == 4) {
+		/* Label reference */
+		add_reloc(t2.str, cur_index + 2);
 	}
+
+	cur_index += 4;
 }
 
-static void parse_instruction_st(instruction &ins)
+void Assembler::parse_instruction_st(instruction &ins)
 {
 	/* In ST, r1 is optional IMM/REGPTR, and r2 is mandatory REG */
 	/* In LD, r1 is mandatory REG, and r2 is optional IMM/REGPTR */
 	token t1 = ins.tokens[1];
 	token t2 = ins.tokens[2];
 
-	long rx_val;
-	int rx_result = parse_register(t2.str);
+	int rx_result = parse_register(t2.str, ins.line_no);
 
 	long opt_val;
-	int opt_result = parse_register_or_imm(t1.str, opt_val);
+	int opt_result = parse_register_or_imm(t1.str, opt_val, ins.line_no);
 
 	if (opt_result == -1 || rx_result == -1) {
-		cerr << "Error on line " << ins.line_no << ": Invalid register/imm: " << t1.str << " or " << t2.str << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid register/imm: " + t1.str + " or " + t2.str);
 		return;
 	}
 
-	if (opt_result == 4) {
-		/* Label reference */
-		ins.opcode = ADMODE_IMM;
-		ins.opcode |= (rx_result & 0x3) << 4;
-		attempt_resolve_label(t1.str, cur_index + 1);
-	} else {
-		ins.opcode = opt_result;
+	ins.opcode = INST_ST << 12;
+	ins.opcode |= (rx_result & 0x3) << 4;
+
+	if (opt_result == ADMODE_REG) {
+		ins.opcode |= (opt_val & 0x3) << 6;
+		write_stream(ins.opcode, cur_index);
+		cur_index += 2;
+		return;
 	}
 
-	ins.opcode |= INST_LD << 12;
+	ins.opcode |= ADMODE_IMM;
+	write_stream(ins.opcode, cur_index);
+	write_stream(opt_val, cur_index + 2);
 
-	if (ins.opcode & ADMODE_IMM) {
-		WRITE_STREAM(ins.opcode, cur_index);
-		WRITE_STREAM(opt_val, cur_index + 2);
-		cur_index += 4;
-	} else {
-		ins.opcode |= (opt_val) << 6;
-		WRITE_STREAM(ins.opcode, cur_index);
-		cur_index += 2;
+	if (opt_result == 4) {
+		/* Label reference */
+		add_reloc(t1.str, cur_index + 2);
 	}
+
+	cur_index += 4;
 }
 
-static void parse_inst_push_pop(instruction &ins)
+void Assembler::parse_inst_push_pop(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 
-	int r1_result = parse_register(t1.str);
-	if (r1_result == -1) {
-		cerr << "Error on line " << ins.line_no << ": Invalid register: " << t1.str << endl;
-		n_errors++;
+	int r1_result = parse_register(t1.str, ins.line_no);
+	if (r1_result == -1)
 		return;
-	}
 
 	ins.opcode <<= 12;
 	ins.opcode |= r1_result << 6;
 
-	WRITE_STREAM(ins.opcode, cur_index);
+	write_stream(ins.opcode, cur_index);
 	cur_index += 2;
 }
 
-static void parse_inst_jnz(instruction &ins)
+void Assembler::parse_inst_jnz(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 
 	long val;
-	int result = parse_register_or_imm(t1.str, val);
+	int result = parse_register_or_imm(t1.str, val, ins.line_no);
 
 	if (result == -1) {
-		cerr << "Error on line " << ins.line_no << ": Invalid register/imm: " << t1.str << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid register/imm: " + t1.str);
 		return;
 	}
 
 	ins.opcode = INST_JNZ << 12;
-	/* either of these bits will result in ADMODE_IMM */
-	ins.opcode |= (result) & 0x8 | ((result & 0x4) << 1);
-
-	if (result == 4) {
-		WRITE_STREAM(ins.opcode, cur_index);
-		attempt_resolve_label(t1.str, cur_index + 2);
-		cur_index += 4;
-	} else if (result == ADMODE_IMM) {
-		WRITE_STREAM(ins.opcode, cur_index);
-		WRITE_STREAM(val, cur_index + 2);
 
-		cur_index += 2;
-	} else {
+	if (result == ADMODE_REG) {
 		ins.opcode |= val << 6;
-		WRITE_STREAM(ins.opcode, cur_index);
+		write_stream(ins.opcode, cur_index);
 		cur_index += 2;
+		return;
 	}
+
+	ins.opcode |= ADMODE_IMM;
+	write_stream(ins.opcode, cur_index);
+	write_stream(val, cur_index + 2);
+
+	if (result == 4)
+		add_reloc(t1.str, cur_index + 2);
+
+	cur_index += 4;
 }
 
-static void parse_inst_cli_sti(instruction &ins)
+void Assembler::parse_inst_cli_sti(instruction &ins)
 {
-	WRITE_STREAM(ins.opcode, cur_index);
+	ins.opcode <<= 12;
+	write_stream(ins.opcode, cur_index);
 	cur_index += 2;
 }
 
-static void parse_inst_int(instruction &ins)
+void Assembler::parse_inst_int(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 
 	long val;
-	int result = parse_register_or_imm(t1.str, val);
+	int result = parse_register_or_imm(t1.str, val, ins.line_no);
 
-	if (result == 4 || result == ADMODE_REG) {
-		cerr << "Error on line " << ins.line_no << ": Invalid imm: " << t1.str << endl;
-		n_errors++;
+	if (result != ADMODE_IMM) {
+		error(ins.line_no, "Invalid imm: " + t1.str);
 		return;
 	}
 
 	ins.opcode = INST_INT << 12;
 	ins.opcode |= ADMODE_IMM;
 
-	stream[cur_index] = LOWER_BYTE(ins.opcode);
-	stream[cur_index + 1] = UPPER_BYTE(ins.opcode);
-	stream[cur_index + 2] = LOWER_BYTE(val);
-	stream[cur_index + 3] = UPPER_BYTE(val);
+	write_stream(ins.opcode, cur_index);
+	write_stream(val, cur_index + 2);
 
 	cur_index += 4;
 }
 
-static void parse_macro_str(instruction &ins)
+void Assembler::parse_macro_str(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 	string str = t1.str.substr(1, t1.str.size() - 2);
 
 	for (size_t i = 0; i < str.size(); i++) {
-		stream[cur_index++] = str[i];
+		write_byte(cur_index++, str[i]);
 	}
 }
 
-static void parse_macro_stz(instruction &ins)
+void Assembler::parse_macro_stz(instruction &ins)
 {
 	parse_macro_str(ins);
-	stream[cur_index++] = 0;
+	write_byte(cur_index++, 0);
 }
 
-static void parse_macro_org(instruction &ins)
+void Assembler::parse_macro_org(instruction &ins)
 {
 	token t1 = ins.tokens[1];
 	long val;
-	int result = parse_register_or_imm(t1.str, val);
+	int result = parse_register_or_imm(t1.str, val, ins.line_no);
 
 	if (result != ADMODE_IMM) {
-		cerr << "Error on line " << ins.line_no << ": Invalid imm: " << t1.str << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid imm: " + t1.str);
 		return;
 	}
 
+	new_section(SEC_ABS, val);
 	cur_index = val;
 }
 
-static void inst_parse(instruction &ins)
+void Assembler::parse_macro_bank(instruction &ins)
+{
+	long bank, window;
+
+	if (parse_register_or_imm(ins.tokens[1].str, bank, ins.line_no) != ADMODE_IMM || bank >= BANK_MAX) {
+		error(ins.line_no, "Invalid bank: " + ins.tokens[1].str);
+		return;
+	}
+
+	if (parse_register_or_imm(ins.tokens[2].str, window, ins.line_no) != ADMODE_IMM ||
+	    (window != BANK_WINDOW(0) && window != BANK_WINDOW(1))) {
+		error(ins.line_no, "Invalid bank window: " + ins.tokens[2].str);
+		return;
+	}
+
+	/* Runs at the window address, stored after the address space */
+	new_section(SEC_ABS | SEC_BANK, window, IMAGE_SIZE + bank * BANK_SIZE);
+	cur_index = window;
+}
+
+void Assembler::inst_parse(instruction &ins)
 {
 	token t0 = ins.tokens[0];
-	static bool macro_mode = false;
 
 	size_t n_expected = 1;
 
 	if (t0.type == token::LABEL) {
-		if (ins.tokens.size() != 1) {
-			cerr << "Error on line " << ins.line_no << ": Expected 1 token, got " << ins.tokens.size();
-			cerr << " (label)" << endl;
-			n_errors++;
-		}
+		if (ins.tokens.size() != 1)
+			error(ins.line_no, "Expected 1 token, got " + std::to_string(ins.tokens.size()) + " (label)");
 		return;
 	}
 
 	struct keyword *kw = asm_keyword_lookup(t0.str.c_str(), t0.str.size());
 	if (!kw) {
-		cerr << "Error on line " << ins.line_no << ": Invalid opcode: " << t0.str << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid opcode: " + t0.str);
 		return;
 	}
 	ins.opcode = kw->opc;
 	n_expected += kw->n_args;
 
 	if (ins.tokens.size() != n_expected && kw->n_args != -1) {
-		cerr << "Error on line " << ins.line_no << ": Expected " << n_expected << " tokens, got " << ins.tokens.size();
-		cerr << " (opcode: " << t0.str << ")" << endl;
-		n_errors++;
+		error(ins.line_no, "Expected " + std::to_string(n_expected) + " tokens, got " + std::to_string(ins.tokens.size()) +
+					   " (opcode: " + t0.str + ")");
+		return;
 	}
 
 	if (macro_mode) {
@@ -441,6 +503,13 @@ static void inst_parse(instruction &ins)
 	case INST_LSH:
 		parse_instruction_arith(ins);
 		break;
+	case INST_XCHG:
+	case INST_CAS:
+	case INST_MUL:
+	case INST_MOVS:
+	case INST_FILL:
+		parse_instruction_ext(ins);
+		break;
 	case INST_ST:
 		parse_instruction_st(ins);
 		break;
@@ -470,67 +539,84 @@ static void inst_parse(instruction &ins)
 	case MACR_ORG:
 		parse_macro_org(ins);
 		break;
+	case MACR_BANK:
+		parse_macro_bank(ins);
+		break;
 	case MACR_DEF:
 		macro_mode = true;
 		break;
 	case MACR_END:
 		break;
 	default:
-		cerr << "Error on line " << ins.line_no << ": Invalid opcode: " << ins.opcode << endl;
-		n_errors++;
+		error(ins.line_no, "Invalid opcode: " + std::to_string(ins.opcode));
 		break;
 	}
 }
 
-string assemble(const string &src)
+int Assembler::assemble_object(std::string_view src, object &out)
 {
 	vector<line> lines;
-	stringstream ss(src);
 
-	string line;
-	for (size_t i = 1; getline(ss, line); i++) {
-		lines.push_back({ line, i });
-	}
+	reset();
 
-	ss.clear();
+	if (!opt_level && !token_cache) {
+		int ret = assemble_chunks(src);
 
-	stream.resize(0x10000);
-	static size_t max_index = 0;
+		if (ret <= 0) {
+			if (ret)
+				return -1;
+			out = std::move(obj);
+			return 0;
+		}
 
-	if (preprocess(lines))
-		return "";
+		/* Too small to split, or has macros */
+		reset();
+	}
 
-	for (int i = 0; i < lines.size(); i++) {
-		cout << lines[i].line << endl;
+	for (size_t pos = 0, i = 1; pos < src.size(); i++) {
+		size_t end = std::min(src.find('\n', pos), src.size());
+
+		lines.push_back({ string(src.substr(pos, end - pos)), i });
+		pos = end + 1;
 	}
 
+	if (preprocess(lines))
+		return -1;
+
 	for (size_t i = 0; i < lines.size(); i++) {
-		instruction ins = tokenize_line(lines[i], i + 1);
-		if (ins.tokens.empty())
-			continue;
+		instruction ins = tokenize_line(lines[i], lines[i].line_no);
+		if (!ins.tokens.empty())
+			instrs.push_back(std::move(ins));
+	}
 
-		if (ins.tokens[0].type == token::LABEL) {
-			string label = ins.tokens[0].str.substr(0, ins.tokens[0].str.size() - 1);
-			if (labels.contains(label)) {
-				cerr << "Error on line " << ins.line_no << ": Duplicate label: " << label << endl;
-				n_errors++;
-				continue;
-			}
-			labels[label] = cur_index;
+	if (opt_level && diags.empty())
+		optimize();
 
-			resolve_label(label);
-		}
+	for (instruction &ins : instrs) {
+		if (ins.tokens[0].type == token::LABEL)
+			add_label(ins.tokens[0].str.substr(0, ins.tokens[0].str.size() - 1), ins.line_no);
 
-		instrs.push_back(ins);
 		inst_parse(ins);
-		if (cur_index > max_index)
-			max_index = cur_index;
 	}
 
-	stream.resize(max_index);
+	if (!diags.empty())
+		return -1;
 
-	if (n_errors)
-		return "";
+	out = std::move(obj);
+
+	return 0;
+}
+
+long Assembler::assemble(std::string_view src, std::span<unsigned char> out, symbol_map *map)
+{
+	vector<object> objs(1);
+
+	link_at_zero = true;
+	int ret = assemble_object(src, objs[0]);
+	link_at_zero = false;
+
+	if (ret)
+		return -1;
 
-	return string(stream.begin(), stream.end());
+	return link_objects(objs, out, diags, map);
 }
@@ -2,6 +2,8 @@
 #pragma once
 
 #include "common.hpp"
+#include "obj.hpp"
+#include "../em/bank.h"
 
 #define INST_CMP 0x0
 #define INST_ADD 0x1
@@ -19,11 +21,23 @@
 #define INST_CLI 0xD
 #define INST_STI 0xE
 #define INST_INT 0xF
+#define INST_EXT 0x20 /* | RRRR sub-opcode, encoded as CMP */
+#define INST_XCHG 0x21
+#define INST_CAS 0x22
+#define INST_MUL 0x23
+#define INST_MOVS 0x24
+#define INST_FILL 0x25
 #define MACR_STR 0x10
 #define MACR_ZST 0x11
 #define MACR_ORG 0x12
 #define MACR_DEF 0x13
 #define MACR_END 0x14
+#define MACR_BANK 0x15
+
+#define IMAGE_SIZE 0x10000
+#define BANK_MAX 256
+/* Banks follow the 64 KB address space in the image */
+#define IMAGE_MAX (IMAGE_SIZE + BANK_MAX * BANK_SIZE)
 
 struct token {
 	enum type {
@@ -52,7 +66,103 @@ struct line {
 	size_t line_no;
 };
 
+struct macro {
+	string name;
+	string body;
+};
+
+struct diagnostic {
+	size_t line_no; /* 0 if not tied to a source line */
+	string msg;
+};
+
+/*
+ * A single assembler run.
+ *
+ * All state lives in the object, so separate instances may assemble
+ * concurrently on different threads. An instance may be reused; every
+ * call to assemble() starts from a clean state.
+ */
+class Assembler {
+public:
+	/* Assemble @src into @out. Returns the image size, or -1 on error */
+	long assemble(std::string_view src, std::span<unsigned char> out, symbol_map *map = nullptr);
+	/*
+	 * Assemble @src into a relocatable object. Returns 0, or -1 on error.
+	 * Large sources without macros are assembled in chunks on all cores.
+	 */
+	int assemble_object(std::string_view src, object &out);
+
+	const vector<diagnostic> &diagnostics() const
+	{
+		return diags;
+	}
+
+	instruction tokenize_line(line &line, size_t line_no);
+
+	/* 0 assembles the source as written, 1 enables the optimizer */
+	void set_opt_level(int level)
+	{
+		opt_level = level;
+	}
+
+	/* Reuse tokenized lines across runs; @cache must outlive the assembler */
+	void set_token_cache(unordered_map<string, vector<token> > *cache)
+	{
+		token_cache = cache;
+	}
+
+private:
+	vector<instruction> instrs;
+	unordered_map<string, size_t> labels;
+	unordered_map<string, macro> macros;
+
+	object obj;
+	vector<size_t> sym_lines; /* source line of each of obj.symbols */
+	size_t cur_sec = 0;
+	size_t cur_index = 0;
+	bool macro_mode = false;
+
+	vector<diagnostic> diags;
+	unordered_map<string, vector<token> > *token_cache = nullptr;
+	int opt_level = 0;
+	bool link_at_zero = false; /* first section is known to start at 0 */
+
+	void reset();
+	void error(size_t line_no, const string &msg);
+	void write_byte(size_t index, unsigned char value);
+	void write_stream(size_t value, size_t index);
+
+	vector<string> tokenize_line_s(const string &line, size_t line_no);
+	int preprocess(vector<line> &lines);
+	macro *macro_register(const string &name, size_t line_no);
+
+	size_t section_base() const;
+	void new_section(uint32_t flags, uint32_t addr, uint32_t load = 0);
+	void add_label(const string &label, size_t line_no);
+	void add_reloc(const string &label, size_t ref_ptr);
+	int parse_register(const string &reg, size_t line_no);
+	int parse_register_or_imm(const string &reg, long &ret, size_t line_no);
+
+	void parse_instruction_arith(instruction &ins);
+	void parse_instruction_ext(instruction &ins);
+	void parse_instruction_ld(instruction &ins);
+	void parse_instruction_st(instruction &ins);
+	void parse_inst_push_pop(instruction &ins);
+	void parse_inst_jnz(instruction &ins);
+	void parse_inst_cli_sti(instruction &ins);
+	void parse_inst_int(instruction &ins);
+	void parse_macro_str(instruction &ins);
+	void parse_macro_stz(instruction &ins);
+	void parse_macro_org(instruction &ins);
+	void parse_macro_bank(instruction &ins);
+	void inst_parse(instruction &ins);
+
+	void optimize();
+
+	int assemble_chunk(std::string_view src, size_t &n_lines);
+	int assemble_chunks(std::string_view src);
+	void check_chunk_labels();
+};
+
 enum token::type get_token_type(const string &token_s);
-instruction tokenize_line(line &line, size_t line_no);
-string assemble(const string &src);
-int preprocess(vector<line> &lines);
@@ -0,0 +1,406 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#pragma once
+
+/*
+ * Compile-time MSC-16 assembler
+ *
+ *	constexpr auto image = casm::assemble<R"(
+ *	.org $100
+ *	loop:
+ *		ld %a, 1
+ *		jnz loop
+ *	)">();
+ *
+ * image is a std::array<uint8_t, N> holding the same bytes asm_image would
+ * produce for the source. Supports every instruction, labels, .org, .string
+ * and .zstring; macros are not supported. Errors fail the compilation at the
+ * offending throw.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace casm {
+
+namespace detail {
+
+/* Mirror of asm_keywords.gperf; keep the two in sync */
+struct keyword {
+	std::string_view name;
+	int opc;
+	int n_args;
+};
+
+inline constexpr keyword keywords[] = {
+	{ "cmp", 0x0, 2 },	 { "add", 0x1, 2 },	  { "sub", 0x2, 2 },  { "jnz", 0x3, 1 },  { "push", 0x4, 1 },
+	{ "pop", 0x5, 1 },	 { "st", 0x6, 2 },	  { "ld", 0x7, 2 },   { "or", 0x8, 2 },	  { "and", 0x9, 2 },
+	{ "xor", 0xa, 2 },	 { "lsh", 0xb, 2 },	  { "rsh", 0xc, 2 },  { "cli", 0xd, 0 },  { "sti", 0xe, 0 },
+	{ "int", 0xf, 1 },	 { ".string", 0x10, 1 }, { ".zstring", 0x11, 1 }, { ".org", 0x12, 1 }, { ".macro", 0x13, -1 },
+	{ ".endm", 0x14, 0 },	 { ".bank", 0x15, 2 },	 { "xchg", 0x21, 2 },	  { "cas", 0x22, 2 },
+	{ "mul", 0x23, 2 },	 { "movs", 0x24, 0 },	  { "fill", 0x25, 0 },
+};
+
+enum {
+	INST_CMP = 0x0,
+	INST_JNZ = 0x3,
+	INST_PUSH = 0x4,
+	INST_POP = 0x5,
+	INST_ST = 0x6,
+	INST_LD = 0x7,
+	INST_RSH = 0xc,
+	INST_CLI = 0xd,
+	INST_STI = 0xe,
+	INST_INT = 0xf,
+	MACR_STR = 0x10,
+	MACR_ZST = 0x11,
+	MACR_ORG = 0x12,
+	INST_EXT = 0x20,
+	INST_MOVS = 0x24,
+	INST_FILL = 0x25,
+};
+
+constexpr std::size_t image_max = 0x10000;
+constexpr uint16_t admode_imm = 0x0008;
+
+constexpr char lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+constexpr const keyword *keyword_lookup(std::string_view s)
+{
+	for (const keyword &kw : keywords) {
+		if (kw.name.size() != s.size())
+			continue;
+
+		bool match = true;
+		for (std::size_t i = 0; i < s.size() && match; i++)
+			match = lower(kw.name[i]) == lower(s[i]);
+
+		if (match)
+			return &kw;
+	}
+
+	return nullptr;
+}
+
+struct label {
+	std::string name;
+	std::size_t addr;
+};
+
+/* Operand forms, matching parse_register_or_imm() */
+enum operand_kind { OP_REG, OP_IMM, OP_LABEL };
+
+struct operand {
+	operand_kind kind;
+	long value;
+	std::string_view name;
+};
+
+constexpr bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+constexpr long parse_number(std::string_view s, int base)
+{
+	long v = 0;
+
+	if (s.empty())
+		throw "casm: empty number";
+
+	for (char c : s) {
+		int d;
+		c = lower(c);
+		if (is_digit(c))
+			d = c - '0';
+		else if (base == 16 && c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else
+			throw "casm: invalid number";
+
+		if (d >= base)
+			throw "casm: invalid number";
+
+		v = v * base + d;
+	}
+
+	return v;
+}
+
+constexpr int parse_register(std::string_view s)
+{
+	if (s.size() != 2 || s[0] != '%' || lower(s[1]) < 'a' || lower(s[1]) > 'd')
+		throw "casm: invalid register";
+
+	return lower(s[1]) - 'a';
+}
+
+constexpr operand parse_operand(std::string_view s)
+{
+	if (s[0] == '%')
+		return { OP_REG, parse_register(s), {} };
+	if (is_digit(s[0]))
+		return { OP_IMM, parse_number(s, 10), {} };
+	if (s[0] == '$')
+		return { OP_IMM, parse_number(s.substr(1), 16), {} };
+
+	return { OP_LABEL, 0, s };
+}
+
+/*
+ * Split one line as tokenize_line_s() does: escape characters are dropped and
+ * '#' ends the line even inside quotes. Token text is copied into @buf, which
+ * the returned tokens point into; returns the token count.
+ */
+constexpr std::size_t tokenize(std::string_view line, std::string &buf, std::array<std::string_view, 8> &tokens)
+{
+	std::array<std::size_t, 9> bounds{};
+	std::size_t n = 0;
+	bool in_token = false;
+	bool quote_open = false;
+	bool is_escape = false;
+
+	buf.clear();
+	auto push = [&]() {
+		if (n == tokens.size())
+			throw "casm: too many tokens";
+		bounds[++n] = buf.size();
+		in_token = false;
+	};
+
+	for (char c : line) {
+		if (c == '#')
+			break;
+
+		if (c == '\\' && !is_escape) {
+			is_escape = true;
+			continue;
+		}
+
+		if (c == '"' && !is_escape)
+			quote_open = !quote_open;
+
+		bool sep = c == ' ' || c == '\t' || c == ',';
+		if (sep && !quote_open) {
+			if (in_token)
+				push();
+		} else {
+			if (!in_token)
+				bounds[n] = buf.size();
+			buf.push_back(c);
+			in_token = true;
+		}
+
+		is_escape = false;
+	}
+
+	if (in_token)
+		push();
+
+	if (quote_open)
+		throw "casm: unclosed quote";
+
+	for (std::size_t i = 0; i < n; i++)
+		tokens[i] = std::string_view(buf).substr(bounds[i], bounds[i + 1] - bounds[i]);
+
+	return n;
+}
+
+class image_writer {
+public:
+	uint8_t *out;
+	std::size_t index = 0;
+	std::size_t max_index = 0;
+
+	constexpr void byte(uint8_t v)
+	{
+		if (index >= image_max)
+			throw "casm: write past end of image";
+		if (out)
+			out[index] = v;
+		index++;
+		if (index > max_index)
+			max_index = index;
+	}
+
+	constexpr void word(long v)
+	{
+		byte(v & 0xFF);
+		byte((v >> 8) & 0xFF);
+	}
+};
+
+constexpr long operand_value(const operand &op, const std::vector<label> &labels, bool resolve)
+{
+	if (op.kind != OP_LABEL)
+		return op.value;
+	if (!resolve)
+		return 0;
+
+	for (const label &l : labels) {
+		if (l.name == op.name)
+			return l.addr;
+	}
+
+	throw "casm: label not found";
+}
+
+/*
+ * One assembler pass. With @resolve unset only label addresses and the
+ * image size are computed; @out may then be null.
+ */
+constexpr std::size_t run_pass(std::string_view src, uint8_t *out, std::vector<label> &labels, bool resolve)
+{
+	image_writer w{ out };
+	std::array<std::string_view, 8> t{};
+	std::string buf;
+
+	while (!src.empty()) {
+		std::size_t eol = src.find('\n');
+		std::string_view line = src.substr(0, eol);
+		src = eol == std::string_view::npos ? std::string_view{} : src.substr(eol + 1);
+
+		std::size_t n = tokenize(line, buf, t);
+		if (!n)
+			continue;
+
+		if (t[0].back() == ':') {
+			if (n != 1)
+				throw "casm: label must be on its own line";
+			if (!resolve) {
+				for (const label &l : labels) {
+					if (l.name == t[0].substr(0, t[0].size() - 1))
+						throw "casm: duplicate label";
+				}
+				labels.push_back({ std::string(t[0].substr(0, t[0].size() - 1)), w.index });
+			}
+			continue;
+		}
+
+		const keyword *kw = keyword_lookup(t[0]);
+		if (!kw)
+			throw "casm: invalid opcode";
+		if (kw->n_args < 0 || (kw->opc > MACR_ORG && !(kw->opc & INST_EXT)))
+			throw "casm: .macro and .bank are not supported";
+		if (n != (std::size_t)kw->n_args + 1)
+			throw "casm: wrong number of operands";
+
+		uint16_t opc = kw->opc & INST_EXT ? (kw->opc & 0xf) << 8 : kw->opc << 12;
+
+		switch (kw->opc) {
+		case INST_LD:
+		case INST_ST: {
+			bool ld = kw->opc == INST_LD;
+			int reg = parse_register(ld ? t[1] : t[2]);
+			operand op = parse_operand(ld ? t[2] : t[1]);
+
+			opc |= reg << (ld ? 6 : 4);
+			if (op.kind == OP_REG) {
+				w.word(opc | op.value << (ld ? 4 : 6));
+			} else {
+				w.word(opc | admode_imm);
+				w.word(operand_value(op, labels, resolve));
+			}
+			break;
+		}
+		case INST_JNZ: {
+			operand op = parse_operand(t[1]);
+			if (op.kind == OP_REG) {
+				w.word(opc | op.value << 6);
+			} else {
+				w.word(opc | admode_imm);
+				w.word(operand_value(op, labels, resolve));
+			}
+			break;
+		}
+		case INST_PUSH:
+		case INST_POP:
+			w.word(opc | parse_register(t[1]) << 6);
+			break;
+		case INST_CLI:
+		case INST_STI:
+		case INST_MOVS:
+		case INST_FILL:
+			w.word(opc);
+			break;
+		case INST_INT: {
+			operand op = parse_operand(t[1]);
+			if (op.kind != OP_IMM)
+				throw "casm: invalid imm";
+			w.word(opc | admode_imm);
+			w.word(op.value);
+			break;
+		}
+		case MACR_STR:
+		case MACR_ZST:
+			if (t[1].size() < 2 || t[1].front() != '"' || t[1].back() != '"')
+				throw "casm: expected a string";
+			for (char c : t[1].substr(1, t[1].size() - 2))
+				w.byte(c);
+			if (kw->opc == MACR_ZST)
+				w.byte(0);
+			break;
+		case MACR_ORG: {
+			operand op = parse_operand(t[1]);
+			if (op.kind != OP_IMM)
+				throw "casm: invalid imm";
+			w.index = op.value;
+			if (w.index > w.max_index)
+				w.max_index = w.index;
+			break;
+		}
+		default:
+			/* Register-register arithmetic */
+			w.word(opc | parse_register(t[1]) << 6 | parse_register(t[2]) << 4);
+			break;
+		}
+	}
+
+	return w.max_index;
+}
+
+constexpr std::size_t assemble(std::string_view src, uint8_t *out)
+{
+	std::vector<label> labels;
+	std::size_t size = run_pass(src, nullptr, labels, false);
+
+	if (out)
+		run_pass(src, out, labels, true);
+
+	return size;
+}
+
+} /* namespace detail */
+
+template <std::size_t N> struct fixed_string {
+	char s[N];
+
+	constexpr fixed_string(const char (&str)[N])
+	{
+		for (std::size_t i = 0; i < N; i++)
+			s[i] = str[i];
+	}
+
+	constexpr std::string_view view() const
+	{
+		return { s, N - 1 };
+	}
+};
+
+template <fixed_string Src> consteval auto assemble()
+{
+	constexpr std::size_t size = detail::assemble(Src.view(), nullptr);
+	std::array<uint8_t, size> image{};
+
+	detail::assemble(Src.view(), image.data());
+
+	return image;
+}
+
+} /* namespace casm */
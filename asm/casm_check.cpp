@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Build-time checks that casm.hpp assembles as asm_image does. The expected
+ * bytes are asm_image output for the same sources; a mismatch fails the build.
+ */
+#include <algorithm>
+#include "casm.hpp"
+
+template <std::size_t N, std::size_t M>
+constexpr bool same(const std::array<uint8_t, N> &image, const uint8_t (&expect)[M])
+{
+	return N == M && std::equal(image.begin(), image.end(), expect);
+}
+
+/* Escape characters are dropped, '#' ends the line even after a quote */
+constexpr uint8_t strings[] = { 0x61, 0x22, 0x62, 0x00, 0x61, 0x5c, 0x62, 0x00, 0x08, 0x70,
+				0x01, 0x00, 0x78, 0x20, 0x79, 0x2c, 0x7a };
+static_assert(same(casm::assemble<R"(
+.zstring "a\"b"
+.zstring "a\\b" # "comment
+ld %a, 1 # ld %b, 2
+.string "x y,z"
+)">(),
+		   strings));
+
+constexpr uint8_t program[] = { 0x00, 0x00, 0x00, 0x00, 0x08, 0x70, 0x34, 0x12, 0x18, 0x60, 0x00,
+				0x00, 0x10, 0x10, 0x08, 0x30, 0x04, 0x00, 0x08, 0xf0, 0x03, 0x00 };
+static_assert(same(casm::assemble<R"(
+.org $4
+loop:
+	ld %a, $1234
+	st $0, %b
+	add %a, %b
+	jnz loop
+	int 3
+)">(),
+		   program));
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <atomic>
+#include <thread>
+#include "common.hpp"
+#include "asm.hpp"
+#include "hash.h"
+#include "parallel.hpp"
+
+/*
+ * Chunked assembly
+ *
+ * Without macros, every line encodes to the same bytes wherever it ends up:
+ * label references are relocations and their operand is always a full word.
+ * So the source is cut at line boundaries and each chunk is assembled by its
+ * own Assembler into an object whose first section continues whatever
+ * section the previous chunk ended in. A prefix sum over the chunks' section
+ * sizes places every chunk, and the chunks are then copied into one object
+ * in parallel. The linker patches the label references.
+ */
+
+#define CHUNK_MIN 0x10000 /* bytes of source per chunk, at least */
+#define CHUNKS_PER_THREAD 4
+#define LABEL_SHARDS 64
+
+/* Returns 1 if the chunk has a macro, and so needs the sequential pass */
+int Assembler::assemble_chunk(std::string_view src, size_t &n_lines)
+{
+	size_t line_no = 0;
+
+	reset();
+
+	for (size_t pos = 0; pos < src.size();) {
+		size_t end = std::min(src.find('\n', pos), src.size());
+		line l = { string(src.substr(pos, end - pos)), ++line_no };
+
+		pos = end + 1;
+
+		instruction ins = tokenize_line(l, line_no);
+		if (ins.tokens.empty())
+			continue;
+
+		if (ins.tokens[0].type == token::OPC) {
+			struct keyword *kw = asm_keyword_lookup(ins.tokens[0].str.c_str(), ins.tokens[0].str.size());
+
+			if (kw->opc == MACR_DEF || kw->opc == MACR_END)
+				return 1;
+		}
+
+		if (ins.tokens[0].type == token::LABEL)
+			add_label(ins.tokens[0].str.substr(0, ins.tokens[0].str.size() - 1), ins.line_no);
+
+		inst_parse(ins);
+	}
+
+	n_lines = line_no;
+
+	return 0;
+}
+
+/* Labels defined in more than one chunk; each chunk checked its own */
+void Assembler::check_chunk_labels()
+{
+	std::hash<string> hash;
+	vector<size_t> hashes(obj.symbols.size());
+	vector<vector<size_t> > dups(LABEL_SHARDS);
+
+	parallel_for((hashes.size() + 0xFFFF) >> 16, [&](size_t b) {
+		for (size_t i = b << 16; i < std::min(hashes.size(), (b + 1) << 16); i++)
+			hashes[i] = hash(obj.symbols[i].name);
+	});
+
+	parallel_for(LABEL_SHARDS, [&](size_t s) {
+		unordered_map<string, size_t> seen;
+
+		for (size_t i = 0; i < hashes.size(); i++) {
+			if (hashes[i] % LABEL_SHARDS == s && !seen.emplace(obj.symbols[i].name, i).second)
+				dups[s].push_back(i);
+		}
+	});
+
+	for (const vector<size_t> &syms : dups)
+		for (size_t i : syms)
+			error(sym_lines[i], "Duplicate label: " + obj.symbols[i].name);
+}
+
+/* Returns 0, -1 on error, or 1 if @src needs the sequential pass */
+int Assembler::assemble_chunks(std::string_view src)
+{
+	size_t n = std::min<size_t>(src.size() / CHUNK_MIN, std::max(1u, std::thread::hardware_concurrency()) * CHUNKS_PER_THREAD);
+
+	if (n < 2)
+		return 1;
+
+	/* Cut at the first line boundary after each even split */
+	vector<size_t> start(n + 1, src.size());
+	start[0] = 0;
+	for (size_t i = 1; i < n; i++) {
+		size_t pos = src.find('\n', std::max(i * src.size() / n, start[i - 1]));
+
+		start[i] = pos == src.npos ? src.size() : pos + 1;
+	}
+
+	vector<Assembler> chunks(n);
+	vector<size_t> n_lines(n);
+	std::atomic<bool> has_macros = false;
+
+	parallel_for(n, [&](size_t i) {
+		if (has_macros.load(std::memory_order_relaxed))
+			return;
+		if (chunks[i].assemble_chunk(src.substr(start[i], start[i + 1] - start[i]), n_lines[i]))
+			has_macros.store(true, std::memory_order_relaxed);
+	});
+
+	if (has_macros)
+		return 1;
+
+	/*
+	 * Prefix sums: a chunk's first section goes on the end of the current
+	 * one, each of its .org and .bank sections starts a new one.
+	 */
+	struct placement {
+		size_t sec;
+		size_t shift;
+	};
+	vector<vector<placement> > place(n);
+	vector<size_t> sizes(1, 0);
+	vector<bool> continued(1, false);
+	vector<size_t> sym_base(n + 1), rel_base(n + 1), line_base(n + 1);
+
+	for (size_t k = 0; k < n; k++) {
+		const object &c = chunks[k].obj;
+
+		for (size_t s = 0; s < c.sections.size(); s++) {
+			const obj_section &sec = c.sections[s];
+
+			if (s) {
+				new_section(sec.flags, sec.addr, sec.load);
+				sizes.push_back(0);
+				continued.push_back(false);
+			} else if (k && !sec.data.empty()) {
+				continued[cur_sec] = true;
+			}
+
+			place[k].push_back({ cur_sec, sizes[cur_sec] });
+			sizes[cur_sec] += sec.data.size();
+		}
+
+		sym_base[k + 1] = sym_base[k] + c.symbols.size();
+		rel_base[k + 1] = rel_base[k] + c.relocs.size();
+		line_base[k + 1] = line_base[k] + n_lines[k];
+	}
+
+	for (size_t s = 0; s < obj.sections.size(); s++)
+		obj.sections[s].data.resize(sizes[s]);
+	obj.symbols.resize(sym_base[n]);
+	sym_lines.resize(sym_base[n]);
+	obj.relocs.resize(rel_base[n]);
+
+	parallel_for(n, [&](size_t k) {
+		Assembler &c = chunks[k];
+
+		for (size_t s = 0; s < c.obj.sections.size(); s++) {
+			const vector<unsigned char> &data = c.obj.sections[s].data;
+
+			std::copy(data.begin(), data.end(), obj.sections[place[k][s].sec].data.begin() + place[k][s].shift);
+		}
+
+		for (size_t i = 0; i < c.obj.symbols.size(); i++) {
+			obj_symbol &sym = obj.symbols[sym_base[k] + i];
+			const placement &p = place[k][c.obj.symbols[i].section];
+
+			sym = std::move(c.obj.symbols[i]);
+			sym.section = p.sec;
+			sym.offset += p.shift;
+			sym_lines[sym_base[k] + i] = c.sym_lines[i] + line_base[k];
+		}
+
+		for (size_t i = 0; i < c.obj.relocs.size(); i++) {
+			obj_reloc &rel = obj.relocs[rel_base[k] + i];
+			const placement &p = place[k][c.obj.relocs[i].section];
+
+			rel = std::move(c.obj.relocs[i]);
+			rel.section = p.sec;
+			rel.offset += p.shift;
+		}
+
+		for (diagnostic &d : c.diags) {
+			if (d.line_no)
+				d.line_no += line_base[k];
+		}
+	});
+
+	for (const Assembler &c : chunks)
+		diags.insert(diags.end(), c.diags.begin(), c.diags.end());
+
+	/* A chunk only checked the bounds of sections it started */
+	for (size_t s = 0; s < obj.sections.size(); s++) {
+		const obj_section &sec = obj.sections[s];
+		size_t base = (sec.flags & SEC_ABS) ? sec.addr : 0;
+
+		if (!continued[s])
+			continue;
+
+		if (base + sec.data.size() > IMAGE_SIZE)
+			error(0, "Write past end of image at " + std::to_string(IMAGE_SIZE));
+		else if ((sec.flags & SEC_BANK) && sec.data.size() > BANK_SIZE)
+			error(0, "Write past end of bank window at " + std::to_string(sec.addr + BANK_SIZE));
+	}
+
+	check_chunk_labels();
+
+	return diags.empty() ? 0 : -1;
+}
@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include "common.hpp"
+#include "asm.hpp"
+#include "obj.hpp"
+#include "parallel.hpp"
+
+#define SYMTAB_SHARDS 64
+#define LINK_BLOCK 4096 /* symbols or relocations per parallel job */
+
+struct symtab_entry {
+	uint32_t addr;
+	uint32_t obj;
+};
+
+typedef unordered_map<string, symtab_entry> symtab_shard;
+
+int read_objects(const vector<string> &paths, vector<object> &objs, vector<diagnostic> &diags)
+{
+	vector<string> errs(paths.size());
+
+	objs.resize(paths.size());
+	parallel_for(paths.size(), [&](size_t i) { obj_read(objs[i], paths[i], errs[i]); });
+
+	int ret = 0;
+	for (const string &err : errs) {
+		if (err.empty())
+			continue;
+
+		diags.push_back({ 0, err });
+		ret = -1;
+	}
+
+	return ret;
+}
+
+long link_objects(vector<object> &objs, std::span<unsigned char> out, vector<diagnostic> &diags, symbol_map *map)
+{
+	std::hash<string> hash;
+	size_t n_diags = diags.size();
+
+	/*
+	 * Lay out sections; a relocatable section follows whatever came before it.
+	 * Bank sections run at @base but are stored at their load offset.
+	 */
+	vector<vector<uint32_t> > base(objs.size());
+	vector<vector<uint32_t> > load(objs.size());
+	uint32_t cursor = 0;
+	uint32_t image_end = 0;
+
+	for (size_t o = 0; o < objs.size(); o++) {
+		for (const obj_section &sec : objs[o].sections) {
+			uint32_t b = (sec.flags & SEC_ABS) ? sec.addr : cursor;
+			uint32_t l = (sec.flags & SEC_BANK) ? sec.load : b;
+
+			base[o].push_back(b);
+			load[o].push_back(l);
+			if (!(sec.flags & SEC_BANK))
+				cursor = b + sec.data.size();
+			image_end = std::max(image_end, (uint32_t)(l + sec.data.size()));
+		}
+	}
+
+	if (image_end > out.size()) {
+		diags.push_back({ 0, "Image too large: " + std::to_string(image_end) + " bytes" });
+		return -1;
+	}
+
+	/* Bank contents are not the address space; nothing may silently replace them */
+	struct bank_range {
+		uint32_t begin;
+		uint32_t end;
+		size_t obj;
+	};
+	vector<bank_range> banks;
+	for (size_t o = 0; o < objs.size(); o++) {
+		for (size_t s = 0; s < objs[o].sections.size(); s++) {
+			const obj_section &sec = objs[o].sections[s];
+
+			if ((sec.flags & SEC_BANK) && !sec.data.empty())
+				banks.push_back({ load[o][s], (uint32_t)(load[o][s] + sec.data.size()), o });
+		}
+	}
+	std::sort(banks.begin(), banks.end(), [](const bank_range &x, const bank_range &y) { return x.begin < y.begin; });
+	for (size_t i = 1; i < banks.size(); i++) {
+		if (banks[i].begin >= banks[i - 1].end)
+			continue;
+
+		string msg = "Bank " + std::to_string((banks[i].begin - IMAGE_SIZE) / BANK_SIZE) + " sections overlap";
+		if (banks[i].obj != banks[i - 1].obj)
+			msg = objs[banks[i].obj].name + ": " + msg + " (with " + objs[banks[i - 1].obj].name + ")";
+		diags.push_back({ 0, msg });
+	}
+	if (diags.size() != n_diags)
+		return -1;
+
+	/*
+	 * Work is split into blocks of LINK_BLOCK symbols or relocations, so one
+	 * large object is spread over the threads as well as many small ones.
+	 */
+	struct link_block {
+		uint32_t obj;
+		uint32_t begin;
+		uint32_t end;
+	};
+	vector<link_block> sym_blocks, rel_blocks;
+	for (uint32_t o = 0; o < objs.size(); o++) {
+		for (uint32_t i = 0; i < objs[o].symbols.size(); i += LINK_BLOCK)
+			sym_blocks.push_back({ o, i, std::min<uint32_t>(i + LINK_BLOCK, objs[o].symbols.size()) });
+		for (uint32_t i = 0; i < objs[o].relocs.size(); i += LINK_BLOCK)
+			rel_blocks.push_back({ o, i, std::min<uint32_t>(i + LINK_BLOCK, objs[o].relocs.size()) });
+	}
+
+	/* Bucket each block's symbols by shard, then build the shards in parallel */
+	vector<vector<vector<uint32_t> > > buckets(sym_blocks.size());
+	parallel_for(sym_blocks.size(), [&](size_t b) {
+		const link_block &blk = sym_blocks[b];
+
+		buckets[b].resize(SYMTAB_SHARDS);
+		for (uint32_t i = blk.begin; i < blk.end; i++)
+			buckets[b][hash(objs[blk.obj].symbols[i].name) % SYMTAB_SHARDS].push_back(i);
+	});
+
+	vector<symtab_shard> symtab(SYMTAB_SHARDS);
+	vector<vector<string> > shard_errs(SYMTAB_SHARDS);
+	parallel_for(SYMTAB_SHARDS, [&](size_t s) {
+		for (size_t b = 0; b < sym_blocks.size(); b++) {
+			size_t o = sym_blocks[b].obj;
+
+			for (uint32_t i : buckets[b][s]) {
+				const obj_symbol &sym = objs[o].symbols[i];
+
+				if (sym.section >= objs[o].sections.size()) {
+					shard_errs[s].push_back(objs[o].name + ": bad section for symbol " + sym.name);
+					continue;
+				}
+
+				symtab_entry e = { base[o][sym.section] + sym.offset, (uint32_t)o };
+				auto [it, inserted] = symtab[s].emplace(sym.name, e);
+				if (!inserted)
+					shard_errs[s].push_back(objs[o].name + ": duplicate symbol " + sym.name + " (first defined in " +
+								objs[it->second.obj].name + ")");
+			}
+		}
+	});
+
+	/* Patch every block of relocations in parallel; they never share bytes */
+	vector<vector<string> > rel_errs(rel_blocks.size());
+	parallel_for(rel_blocks.size(), [&](size_t b) {
+		size_t o = rel_blocks[b].obj;
+
+		for (uint32_t r = rel_blocks[b].begin; r < rel_blocks[b].end; r++) {
+			const obj_reloc &rel = objs[o].relocs[r];
+
+			if (rel.section >= objs[o].sections.size() || rel.offset + 2 > objs[o].sections[rel.section].data.size()) {
+				rel_errs[b].push_back(objs[o].name + ": bad relocation for " + rel.symbol);
+				continue;
+			}
+
+			symtab_shard &shard = symtab[hash(rel.symbol) % SYMTAB_SHARDS];
+			auto it = shard.find(rel.symbol);
+			if (it == shard.end()) {
+				rel_errs[b].push_back(objs[o].name + ": undefined symbol " + rel.symbol);
+				continue;
+			}
+
+			vector<unsigned char> &data = objs[o].sections[rel.section].data;
+			data[rel.offset] = it->second.addr & 0xFF;
+			data[rel.offset + 1] = (it->second.addr >> 8) & 0xFF;
+		}
+	});
+
+	for (auto &errs : shard_errs)
+		for (string &err : errs)
+			diags.push_back({ 0, err });
+	for (auto &errs : rel_errs)
+		for (string &err : errs)
+			diags.push_back({ 0, err });
+
+	if (diags.size() != n_diags)
+		return -1;
+
+	/* Other sections may overlap; later ones win, as with .org in a single file */
+	std::fill(out.begin(), out.begin() + image_end, 0);
+	for (size_t o = 0; o < objs.size(); o++) {
+		for (size_t s = 0; s < objs[o].sections.size(); s++) {
+			const vector<unsigned char> &data = objs[o].sections[s].data;
+			std::copy(data.begin(), data.end(), out.begin() + load[o][s]);
+		}
+	}
+
+	if (map) {
+		map->clear();
+		for (const symtab_shard &shard : symtab)
+			for (auto &[name, e] : shard)
+				map->push_back({ e.addr, name });
+		std::sort(map->begin(), map->end());
+	}
+
+	return image_end;
+}
+
+int write_symbol_map(const symbol_map &map, const string &path)
+{
+	ofstream ofile(path);
+	char addr[8];
+
+	for (auto &[a, name] : map) {
+		snprintf(addr, sizeof(addr), "%04x", a);
+		ofile << addr << ' ' << name << '\n';
+	}
+
+	return ofile ? 0 : -1;
+}
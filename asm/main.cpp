@@ -1,23 +1,86 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "common.hpp"
 #include "asm.hpp"
+#include "obj.hpp"
+#include "watch.hpp"
 
-static string read_file(const string &if_name)
+/* Map @if_name read-only, so large sources are split without a copy */
+static std::string_view map_file(const string &if_name)
 {
-	ifstream ifile(if_name);
-	if (!ifile) {
+	struct stat st;
+	void *p = MAP_FAILED;
+	int fd = open(if_name.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st)) {
 		cerr << "Error: cannot open file " << if_name << '\n';
+		if (fd >= 0)
+			close(fd);
+		return {};
 	}
 
-	string buf;
+	if (st.st_size)
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		return {};
+
+	return { (const char *)p, (size_t)st.st_size };
+}
 
-	string line;
-	while (getline(ifile, line)) {
-		buf += line + '\n';
+static void print_diagnostics(const vector<diagnostic> &diags)
+{
+	for (const diagnostic &d : diags) {
+		if (d.line_no)
+			cerr << "Error on line " << d.line_no << ": " << d.msg << endl;
+		else
+			cerr << "Error: " << d.msg << endl;
 	}
+}
+
+static int write_image(const string &of_name, const vector<unsigned char> &image, long size)
+{
+	if (size < 0)
+		return 1;
+
+	ofstream ofile(of_name, std::ios::binary);
+	ofile.write((const char *)image.data(), size);
+
+	return 0;
+}
+
+static int write_map(const string &map_name, const symbol_map &map)
+{
+	if (map_name.empty())
+		return 0;
+
+	if (write_symbol_map(map, map_name)) {
+		cerr << "Error: cannot write " << map_name << endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int link_main(const vector<string> &inputs, const string &of_name, const string &map_name)
+{
+	vector<object> objs;
+	vector<diagnostic> diags;
+	vector<unsigned char> image(IMAGE_MAX);
+	symbol_map map;
+	long size = -1;
 
-	return buf;
+	if (!read_objects(inputs, objs, diags))
+		size = link_objects(objs, image, diags, &map);
+
+	print_diagnostics(diags);
+
+	return write_image(of_name, image, size) || (size >= 0 && write_map(map_name, map));
 }
 
 int main(int argc, char *argv[])
@@ -27,8 +90,14 @@ int main(int argc, char *argv[])
 
 	string if_name;
 	string of_name;
+	bool relocatable = false;
+	bool link = false;
+	bool watch = false;
+	string sock_path;
+	string map_name;
+	int opt_level = 0;
 
-	while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+	while ((opt = getopt(argc, argv, "c:o:rlws:Om:")) != -1) {
 		switch (opt) {
 		case 'c':
 			if_name = optarg;
@@ -36,24 +105,70 @@ int main(int argc, char *argv[])
 		case 'o':
 			of_name = optarg;
 			break;
+		case 'r':
+			relocatable = true;
+			break;
+		case 'l':
+			link = true;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'O':
+			opt_level = 1;
+			break;
+		case 'm':
+			map_name = optarg;
+			break;
 		default:
-			cerr << "Usage: " << argv[0] << " [-co] [file...]\n";
+			cerr << "Usage: " << argv[0] << " [-rO] [-c file] [-o file] [-m map]\n";
+			cerr << "       " << argv[0] << " -l [-o file] [-m map] object...\n";
+			cerr << "       " << argv[0] << " -w [-s socket] [-o file] source...\n";
 			return 1;
 		}
 	}
 
+	if (of_name.empty())
+		of_name = relocatable ? "out.o" : "out.bin";
+
+	if (link)
+		return link_main(vector<string>(argv + optind, argv + argc), of_name, map_name);
+
+	if (watch) {
+		vector<string> inputs(argv + optind, argv + argc);
+		if (!if_name.empty())
+			inputs.insert(inputs.begin(), if_name);
+
+		return watch_main(inputs, of_name, sock_path);
+	}
+
 	if (if_name.empty())
 		if_name = "test.s";
 
-	if (of_name.empty())
-		of_name = "out.bin";
+	std::string_view buf = map_file(if_name);
+
+	Assembler as;
+	as.set_opt_level(opt_level);
 
-	string buf = read_file(if_name);
+	if (relocatable) {
+		object obj;
+		int ret = as.assemble_object(buf, obj);
 
-	string ret = assemble(buf);
+		print_diagnostics(as.diagnostics());
+		if (ret)
+			return 1;
 
-	ofstream ofile(of_name);
-	ofile << ret;
+		return obj_write(obj, of_name) ? 1 : 0;
+	}
 
-	return 0;
+	vector<unsigned char> image(IMAGE_MAX);
+	symbol_map map;
+	long size = as.assemble(buf, image, &map);
+
+	print_diagnostics(as.diagnostics());
+
+	return write_image(of_name, image, size) || (size >= 0 && write_map(map_name, map));
 }
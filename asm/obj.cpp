@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "common.hpp"
+#include "obj.hpp"
+
+/*
+ * On-disk layout, all fields little-endian u32:
+ *
+ *   magic, version, n_sections, n_symbols, n_relocs
+ *   sections: flags, addr, load, size, data...
+ *   symbols:  section, offset, name_len, name...
+ *   relocs:   section, offset, name_len, name...
+ */
+
+static void put32(string &buf, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		buf.push_back((v >> (i * 8)) & 0xFF);
+}
+
+static void put_str(string &buf, const string &s)
+{
+	put32(buf, s.size());
+	buf += s;
+}
+
+struct obj_reader {
+	const string &buf;
+	size_t pos = 0;
+	bool bad = false;
+
+	uint32_t get32()
+	{
+		if (pos + 4 > buf.size()) {
+			bad = true;
+			return 0;
+		}
+
+		uint32_t v = 0;
+		for (int i = 0; i < 4; i++)
+			v |= (uint32_t)(unsigned char)buf[pos + i] << (i * 8);
+		pos += 4;
+
+		return v;
+	}
+
+	string get_bytes(size_t n)
+	{
+		if (pos + n > buf.size()) {
+			bad = true;
+			return "";
+		}
+
+		string s = buf.substr(pos, n);
+		pos += n;
+
+		return s;
+	}
+};
+
+int obj_write(const object &obj, const string &path)
+{
+	string buf;
+
+	put32(buf, OBJ_MAGIC);
+	put32(buf, OBJ_VERSION);
+	put32(buf, obj.sections.size());
+	put32(buf, obj.symbols.size());
+	put32(buf, obj.relocs.size());
+
+	for (const obj_section &sec : obj.sections) {
+		put32(buf, sec.flags);
+		put32(buf, sec.addr);
+		put32(buf, sec.load);
+		put32(buf, sec.data.size());
+		buf.append(sec.data.begin(), sec.data.end());
+	}
+
+	for (const obj_symbol &sym : obj.symbols) {
+		put32(buf, sym.section);
+		put32(buf, sym.offset);
+		put_str(buf, sym.name);
+	}
+
+	for (const obj_reloc &rel : obj.relocs) {
+		put32(buf, rel.section);
+		put32(buf, rel.offset);
+		put_str(buf, rel.symbol);
+	}
+
+	ofstream ofile(path, std::ios::binary);
+	ofile.write(buf.data(), buf.size());
+
+	return ofile ? 0 : -1;
+}
+
+int obj_read(object &obj, const string &path, string &err)
+{
+	ifstream ifile(path, std::ios::binary);
+	if (!ifile) {
+		err = "cannot open file " + path;
+		return -1;
+	}
+
+	string buf((std::istreambuf_iterator<char>(ifile)), std::istreambuf_iterator<char>());
+	obj_reader r{ buf };
+
+	obj = object{};
+	obj.name = path;
+
+	if (r.get32() != OBJ_MAGIC || r.get32() != OBJ_VERSION) {
+		err = path + ": not an MSC-16 object (or wrong version)";
+		return -1;
+	}
+
+	uint32_t n_sections = r.get32();
+	uint32_t n_symbols = r.get32();
+	uint32_t n_relocs = r.get32();
+
+	for (uint32_t i = 0; i < n_sections && !r.bad; i++) {
+		obj_section sec;
+		sec.flags = r.get32();
+		sec.addr = r.get32();
+		sec.load = r.get32();
+		string data = r.get_bytes(r.get32());
+		sec.data.assign(data.begin(), data.end());
+		obj.sections.push_back(std::move(sec));
+	}
+
+	for (uint32_t i = 0; i < n_symbols && !r.bad; i++) {
+		obj_symbol sym;
+		sym.section = r.get32();
+		sym.offset = r.get32();
+		sym.name = r.get_bytes(r.get32());
+		obj.symbols.push_back(std::move(sym));
+	}
+
+	for (uint32_t i = 0; i < n_relocs && !r.bad; i++) {
+		obj_reloc rel;
+		rel.section = r.get32();
+		rel.offset = r.get32();
+		rel.symbol = r.get_bytes(r.get32());
+		obj.relocs.push_back(std::move(rel));
+	}
+
+	if (r.bad) {
+		err = path + ": truncated object";
+		return -1;
+	}
+
+	return 0;
+}
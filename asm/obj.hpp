@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#pragma once
+
+#include "common.hpp"
+
+/*
+ * Relocatable object format
+ *
+ * An object is a list of sections. The first section of an object holds
+ * everything before the first .org and is placed wherever the previous
+ * object ended; every .org starts a new section at a fixed address. A .bank
+ * section runs at its window address but is stored at @load in the image.
+ * Label references are recorded as relocations and patched by the linker.
+ */
+
+#define OBJ_MAGIC 0x4f43534d /* "MSCO" */
+#define OBJ_VERSION 2
+
+#define SEC_ABS 0x1
+#define SEC_BANK 0x2
+
+struct obj_section {
+	uint32_t flags;
+	uint32_t addr; /* only meaningful with SEC_ABS */
+	uint32_t load; /* image offset, only meaningful with SEC_BANK */
+	vector<unsigned char> data;
+};
+
+struct obj_symbol {
+	string name;
+	uint32_t section;
+	uint32_t offset;
+};
+
+/* 16-bit little-endian absolute address of @symbol */
+struct obj_reloc {
+	uint32_t section;
+	uint32_t offset;
+	string symbol;
+};
+
+struct object {
+	string name;
+	vector<obj_section> sections;
+	vector<obj_symbol> symbols;
+	vector<obj_reloc> relocs;
+};
+
+struct diagnostic;
+
+int obj_write(const object &obj, const string &path);
+int obj_read(object &obj, const string &path, string &err);
+
+typedef vector<std::pair<uint32_t, string> > symbol_map;
+
+/*
+ * Link @objs into @out. Returns the image size, or -1 on error. If @map is
+ * set it receives every symbol's address, sorted by address.
+ */
+long link_objects(vector<object> &objs, std::span<unsigned char> out, vector<diagnostic> &diags, symbol_map *map = nullptr);
+int write_symbol_map(const symbol_map &map, const string &path);
+/* Read every object in @paths, in parallel */
+int read_objects(const vector<string> &paths, vector<object> &objs, vector<diagnostic> &diags);
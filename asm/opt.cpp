@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "common.hpp"
+#include "asm.hpp"
+#include "hash.h"
+
+/*
+ * Optimizer (-O)
+ *
+ * Works on the tokenized instruction list before encoding. Every MSC-16
+ * instruction sets Z/N from its result, and JNZ reads the flags left by the
+ * instruction right before it, so flags are tracked like a fifth register.
+ *
+ * 1. Dead code: a backward liveness pass removes register-only instructions
+ *    (arithmetic, CMP, LD) whose destination and flags are both dead.
+ *    Liveness is exact inside a basic block; everything is live across JNZ,
+ *    INT and directives.
+ * 2. Shorter encodings: a forward pass tracks registers holding a known
+ *    immediate or label address within a block, and rewrites "jnz X" to
+ *    "jnz %r" and "ld %d, X" to "ld %d, %r" when %r already holds X.
+ *    Comparing a number with a label depends on the final layout, so those
+ *    rewrites start out optimistic and are undone until layout reaches a
+ *    fixed point.
+ *
+ * Code moves, so jumps to numeric addresses are not safe under -O.
+ */
+
+#define OPT_FLAGS 0x10
+#define OPT_ALL 0x1f
+
+struct opt_info {
+	enum kind {
+		LABEL,
+		INST,
+		BARRIER, /* directive, macro body or anything not understood */
+	} kind;
+
+	int opc;
+	bool pure; /* no effects besides @writes */
+	uint8_t reads;
+	uint8_t writes;
+	int dest; /* register written, or -1 */
+	int val_tok; /* index of the imm/label operand, or -1 */
+};
+
+struct opt_value {
+	enum { NONE, NUM, LABEL } kind;
+	long num;
+	string label;
+};
+
+struct opt_rewrite {
+	size_t ins;
+	int reg;
+	bool layout_dependent;
+	string label; /* for layout-dependent rewrites */
+	long num;
+	bool rejected;
+};
+
+static int opt_reg(const token &t)
+{
+	if (t.type != token::REG || t.str.size() != 2)
+		return -1;
+
+	int r = tolower(t.str[1]) - 'a';
+
+	return (r < 0 || r > 3) ? -1 : r;
+}
+
+static opt_value opt_operand(const token &t)
+{
+	switch (t.type) {
+	case token::IMM_DEC:
+		return { opt_value::NUM, (long)stoul(t.str), "" };
+	case token::IMM_HEX:
+		return { opt_value::NUM, (long)stoul(t.str.substr(1), nullptr, 16), "" };
+	case token::LABEL_REF:
+		return { opt_value::LABEL, 0, t.str };
+	default:
+		return { opt_value::NONE, 0, "" };
+	}
+}
+
+static bool opt_same(const opt_value &a, const opt_value &b)
+{
+	if (a.kind == opt_value::NONE || a.kind != b.kind)
+		return false;
+
+	return a.kind == opt_value::NUM ? (a.num & 0xFFFF) == (b.num & 0xFFFF) : a.label == b.label;
+}
+
+static opt_info opt_analyse(const instruction &ins, bool in_macro)
+{
+	opt_info info = { opt_info::BARRIER, -1, false, OPT_ALL, OPT_ALL, -1, -1 };
+	const vector<token> &t = ins.tokens;
+
+	if (t[0].type == token::LABEL) {
+		info.kind = opt_info::LABEL;
+		return info;
+	}
+
+	struct keyword *kw = asm_keyword_lookup(t[0].str.c_str(), t[0].str.size());
+	if (in_macro || !kw || kw->opc > INST_INT || t.size() != (size_t)kw->n_args + 1)
+		return info;
+
+	info.kind = opt_info::INST;
+	info.opc = kw->opc;
+
+	int r1 = t.size() > 1 ? opt_reg(t[1]) : -1;
+	int r2 = t.size() > 2 ? opt_reg(t[2]) : -1;
+
+	switch (kw->opc) {
+	case INST_CMP:
+		if (r1 < 0 || r2 < 0)
+			break;
+		info.pure = true;
+		info.reads = 1 << r1 | 1 << r2;
+		info.writes = OPT_FLAGS;
+		return info;
+	case INST_ADD:
+	case INST_SUB:
+	case INST_OR:
+	case INST_AND:
+	case INST_XOR:
+	case INST_LSH:
+	case INST_RSH:
+		if (r1 < 0 || r2 < 0)
+			break;
+		info.pure = true;
+		info.reads = 1 << r1 | 1 << r2;
+		info.writes = 1 << r1 | OPT_FLAGS;
+		info.dest = r1;
+		return info;
+	case INST_LD:
+		if (r1 < 0)
+			break;
+		info.pure = true;
+		info.writes = 1 << r1 | OPT_FLAGS;
+		info.dest = r1;
+		if (r2 >= 0) {
+			info.reads = 1 << r2;
+		} else if (opt_operand(t[2]).kind != opt_value::NONE) {
+			info.reads = 0;
+			info.val_tok = 2;
+		} else {
+			break;
+		}
+		return info;
+	case INST_JNZ:
+		info.reads = OPT_ALL;
+		info.writes = OPT_FLAGS;
+		if (r1 < 0 && opt_operand(t[1]).kind != opt_value::NONE)
+			info.val_tok = 1;
+		return info;
+	case INST_PUSH:
+		info.reads = OPT_ALL;
+		info.writes = OPT_FLAGS;
+		return info;
+	case INST_POP:
+		if (r1 < 0)
+			break;
+		info.reads = 0;
+		info.writes = 1 << r1 | OPT_FLAGS;
+		info.dest = r1;
+		return info;
+	case INST_ST:
+		/*
+		 * Register-form ST writes its first operand. ST $X stores into its
+		 * own operand word whatever X is, so X is not a value that a
+		 * register holding it could stand in for: no val_tok.
+		 */
+		info.reads = OPT_ALL;
+		info.writes = (r1 >= 0 ? 1 << r1 : 0) | OPT_FLAGS;
+		info.dest = r1;
+		return info;
+	case INST_CLI:
+	case INST_STI:
+		info.reads = 0;
+		info.writes = OPT_FLAGS;
+		return info;
+	default:
+		/* INT may enter a handler that reads anything */
+		return info;
+	}
+
+	info.kind = opt_info::BARRIER;
+	return info;
+}
+
+static vector<opt_info> opt_analyse_all(const vector<instruction> &instrs)
+{
+	vector<opt_info> infos;
+	bool in_macro = false;
+
+	for (const instruction &ins : instrs) {
+		struct keyword *kw = asm_keyword_lookup(ins.tokens[0].str.c_str(), ins.tokens[0].str.size());
+
+		if (kw && kw->opc == MACR_DEF)
+			in_macro = true;
+
+		infos.push_back(opt_analyse(ins, in_macro));
+
+		if (kw && kw->opc == MACR_END)
+			in_macro = false;
+	}
+
+	return infos;
+}
+
+static size_t opt_remove_dead(vector<instruction> &instrs)
+{
+	vector<opt_info> infos = opt_analyse_all(instrs);
+	vector<bool> dead(instrs.size());
+	uint8_t live = OPT_ALL;
+	size_t n_dead = 0;
+
+	for (size_t i = instrs.size(); i-- > 0;) {
+		const opt_info &info = infos[i];
+
+		switch (info.kind) {
+		case opt_info::LABEL:
+			break;
+		case opt_info::BARRIER:
+			live = OPT_ALL;
+			break;
+		case opt_info::INST:
+			if (info.pure && !(info.writes & live)) {
+				dead[i] = true;
+				n_dead++;
+				break;
+			}
+
+			/* Control may leave through JNZ/INT, where anything is live */
+			if (info.opc == INST_JNZ || info.opc == INST_INT)
+				live = OPT_ALL;
+			else
+				live = (live & ~info.writes) | info.reads;
+			break;
+		}
+	}
+
+	size_t j = 0;
+	for (size_t i = 0; i < instrs.size(); i++) {
+		if (dead[i])
+			continue;
+		if (i != j)
+			instrs[j] = std::move(instrs[i]);
+		j++;
+	}
+	instrs.resize(j);
+
+	return n_dead;
+}
+
+static vector<opt_rewrite> opt_find_rewrites(const vector<instruction> &instrs)
+{
+	vector<opt_info> infos = opt_analyse_all(instrs);
+	vector<opt_rewrite> rewrites;
+	opt_value known[4];
+
+	auto forget = [&]() {
+		for (opt_value &v : known)
+			v = { opt_value::NONE, 0, "" };
+	};
+
+	forget();
+	for (size_t i = 0; i < instrs.size(); i++) {
+		const opt_info &info = infos[i];
+
+		if (info.kind != opt_info::INST || info.opc == INST_INT) {
+			forget();
+			continue;
+		}
+
+		opt_value val = { opt_value::NONE, 0, "" };
+		if (info.val_tok >= 0) {
+			val = opt_operand(instrs[i].tokens[info.val_tok]);
+
+			int exact = -1;
+			int maybe = -1;
+			for (int r = 0; r < 4; r++) {
+				if (r == info.dest || known[r].kind == opt_value::NONE)
+					continue;
+
+				if (opt_same(known[r], val) && exact < 0)
+					exact = r;
+				else if (known[r].kind != val.kind && maybe < 0)
+					maybe = r;
+			}
+
+			if (exact >= 0) {
+				rewrites.push_back({ i, exact, false, "", 0, false });
+			} else if (maybe >= 0) {
+				const opt_value &lbl = val.kind == opt_value::LABEL ? val : known[maybe];
+				const opt_value &num = val.kind == opt_value::NUM ? val : known[maybe];
+				rewrites.push_back({ i, maybe, true, lbl.label, num.num & 0xFFFF, false });
+			}
+		}
+
+		if (info.dest < 0)
+			continue;
+
+		if (info.opc == INST_LD && info.val_tok >= 0)
+			known[info.dest] = val;
+		else if (info.opc == INST_LD)
+			known[info.dest] = known[opt_reg(instrs[i].tokens[2])];
+		else
+			known[info.dest] = { opt_value::NONE, 0, "" };
+	}
+
+	return rewrites;
+}
+
+/* Label addresses for the current encoding choices; -1 if not yet known */
+static unordered_map<string, long> opt_layout(const vector<instruction> &instrs, const vector<bool> &is_short, bool link_at_zero)
+{
+	unordered_map<string, long> addrs;
+	bool known = link_at_zero;
+	bool in_macro = false;
+	long cur = 0;
+
+	for (size_t i = 0; i < instrs.size(); i++) {
+		const vector<token> &t = instrs[i].tokens;
+
+		if (t[0].type == token::LABEL) {
+			addrs[t[0].str.substr(0, t[0].str.size() - 1)] = known ? cur : -1;
+			continue;
+		}
+
+		struct keyword *kw = asm_keyword_lookup(t[0].str.c_str(), t[0].str.size());
+		if (!kw)
+			continue;
+
+		if (kw->opc == MACR_DEF)
+			in_macro = true;
+		if (kw->opc == MACR_END)
+			in_macro = false;
+		if (in_macro || t.size() != (size_t)kw->n_args + 1)
+			continue;
+
+		switch (kw->opc) {
+		case INST_LD:
+		case INST_ST:
+		case INST_JNZ:
+		case INST_INT: {
+			const token &op = kw->opc == INST_LD ? t[2] : t[1];
+			cur += (op.type == token::REG || is_short[i]) ? 2 : 4;
+			break;
+		}
+		case MACR_STR:
+		case MACR_ZST:
+			cur += t[1].str.size() - 2 + (kw->opc == MACR_ZST);
+			break;
+		case MACR_ORG:
+			cur = opt_operand(t[1]).num;
+			known = true;
+			break;
+		case MACR_BANK:
+			cur = opt_operand(t[2]).num;
+			known = true;
+			break;
+		default:
+			cur += 2;
+			break;
+		}
+	}
+
+	return addrs;
+}
+
+static size_t opt_relax(vector<instruction> &instrs, bool link_at_zero)
+{
+	vector<opt_rewrite> rewrites = opt_find_rewrites(instrs);
+	vector<bool> is_short(instrs.size());
+
+	for (const opt_rewrite &rw : rewrites)
+		is_short[rw.ins] = true;
+
+	/* Only ever fall back to the long form, so this terminates */
+	for (bool changed = true; changed;) {
+		unordered_map<string, long> addrs = opt_layout(instrs, is_short, link_at_zero);
+
+		changed = false;
+		for (opt_rewrite &rw : rewrites) {
+			if (!rw.layout_dependent || rw.rejected)
+				continue;
+
+			auto it = addrs.find(rw.label);
+			if (it == addrs.end() || it->second != rw.num) {
+				rw.rejected = true;
+				is_short[rw.ins] = false;
+				changed = true;
+			}
+		}
+	}
+
+	size_t n_short = 0;
+	for (const opt_rewrite &rw : rewrites) {
+		if (rw.rejected)
+			continue;
+
+		vector<token> &t = instrs[rw.ins].tokens;
+		t.back() = { token::REG, string("%") + (char)('a' + rw.reg) };
+		n_short++;
+	}
+
+	return n_short;
+}
+
+void Assembler::optimize()
+{
+	opt_remove_dead(instrs);
+	opt_relax(instrs, link_at_zero);
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include "common.hpp"
+
+/* Run fn(i) for every i in [0, n) on up to hardware_concurrency() threads */
+template <typename F> void parallel_for(size_t n, F fn)
+{
+	size_t n_workers = std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+	std::atomic<size_t> next = 0;
+
+	if (n_workers <= 1) {
+		for (size_t i = 0; i < n; i++)
+			fn(i);
+		return;
+	}
+
+	auto worker = [&]() {
+		for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+			fn(i);
+	};
+
+	vector<std::thread> workers;
+	for (size_t i = 1; i < n_workers; i++)
+		workers.emplace_back(worker);
+
+	worker();
+
+	for (std::thread &t : workers)
+		t.join();
+}
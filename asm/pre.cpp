@@ -3,17 +3,10 @@
 #include "asm.hpp"
 #include "hash.h"
 
-struct macro {
-	string name;
-	string body;
-};
-
-static unordered_map<string, macro> macros;
-
-static macro *macro_register(const string &name)
+macro *Assembler::macro_register(const string &name, size_t line_no)
 {
 	if (macros.contains(name)) {
-		cerr << "Error: Macro already defined: " << name << endl;
+		error(line_no, "Macro already defined: " + name);
 		return nullptr;
 	}
 
@@ -24,13 +17,13 @@ static macro *macro_register(const string &name)
 	return &macros[name];
 }
 
-int preprocess(vector<line> &lines)
+int Assembler::preprocess(vector<line> &lines)
 {
 	macro *cur_macro = nullptr;
 	for (int i = 0; i < lines.size(); i++) {
 		line *line = &lines[i];
-		size_t line_no = i + 1;
-		instruction ins = tokenize_line(*line, i + 1);
+		size_t line_no = line->line_no;
+		instruction ins = tokenize_line(*line, line_no);
 
 		if (ins.tokens.empty())
 			continue;
@@ -39,18 +32,23 @@ int preprocess(vector<line> &lines)
 
 		if (kw && kw->opc == MACR_DEF) {
 			if (cur_macro) {
-				cerr << "Error on line " << line_no << ": Nested macro definition" << endl;
+				error(line_no, "Nested macro definition");
+				return -1;
+			}
+
+			if (ins.tokens.size() < 2) {
+				error(line_no, "Macro definition without a name");
 				return -1;
 			}
 
-			macro *m = macro_register(ins.tokens[1].str);
+			macro *m = macro_register(ins.tokens[1].str, line_no);
 			if (!m)
 				return -1;
 
 			cur_macro = m;
 		} else if (kw && kw->opc == MACR_END) {
 			if (!cur_macro) {
-				cerr << "Error on line " << line_no << ": Macro end without definition" << endl;
+				error(line_no, "Macro end without definition");
 				return -1;
 			}
 
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common.hpp"
+#include "asm.hpp"
+#include "obj.hpp"
+#include "watch.hpp"
+#include "../em/hotpatch.h"
+
+/* Merge changed ranges separated by fewer than this many equal bytes */
+#define PATCH_GAP 16
+
+struct watched_file {
+	string path;
+	string dir;
+	string base;
+	string src;
+	object obj;
+	unordered_map<string, vector<token> > tokens;
+};
+
+static string read_all(const string &path)
+{
+	ifstream ifile(path, std::ios::binary);
+
+	return string((std::istreambuf_iterator<char>(ifile)), std::istreambuf_iterator<char>());
+}
+
+static void print_diags(const string &path, const vector<diagnostic> &diags)
+{
+	for (const diagnostic &d : diags) {
+		if (d.line_no)
+			cerr << path << ":" << d.line_no << ": " << d.msg << endl;
+		else
+			cerr << path << ": " << d.msg << endl;
+	}
+}
+
+/* Reassemble @f if its contents changed. Returns 1 if the object changed */
+static int update_file(watched_file &f)
+{
+	string src = read_all(f.path);
+	if (src == f.src)
+		return 0;
+
+	f.src = std::move(src);
+
+	/* Keep the cache from growing without bound across many edits */
+	if (f.tokens.size() > 4 * (size_t)std::count(f.src.begin(), f.src.end(), '\n') + 64)
+		f.tokens.clear();
+
+	Assembler as;
+	as.set_token_cache(&f.tokens);
+
+	object obj;
+	if (as.assemble_object(f.src, obj)) {
+		print_diags(f.path, as.diagnostics());
+		return -1;
+	}
+
+	obj.name = f.path;
+	f.obj = std::move(obj);
+
+	return 1;
+}
+
+static int relink(vector<watched_file> &files, vector<unsigned char> &image, long &size)
+{
+	vector<object> objs;
+	vector<diagnostic> diags;
+
+	for (watched_file &f : files)
+		objs.push_back(f.obj);
+
+	std::fill(image.begin(), image.end(), 0);
+	size = link_objects(objs, image, diags);
+	print_diags("link", diags);
+
+	return size < 0 ? -1 : 0;
+}
+
+static int send_patch(int fd, const sockaddr_un &addr, const vector<unsigned char> &image, size_t start, size_t end)
+{
+	vector<unsigned char> msg;
+
+	for (size_t pos = start; pos < end; pos += HOTPATCH_MAX) {
+		hotpatch_hdr hdr;
+		hdr.magic = HOTPATCH_MAGIC;
+		hdr.addr = pos;
+		hdr.len = std::min<size_t>(HOTPATCH_MAX, end - pos);
+
+		msg.resize(sizeof(hdr) + hdr.len);
+		memcpy(msg.data(), &hdr, sizeof(hdr));
+		memcpy(msg.data() + sizeof(hdr), image.data() + pos, hdr.len);
+
+		if (sendto(fd, msg.data(), msg.size(), 0, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+			perror(addr.sun_path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Send every range that differs between @old_image and @image; -1 if one was not sent */
+static long send_diff(int fd, const sockaddr_un &addr, const vector<unsigned char> &old_image,
+		      const vector<unsigned char> &image)
+{
+	long n_bytes = 0;
+
+	/* Banks are not in guest memory, so only the address space is patched */
+	for (size_t i = 0; i < IMAGE_SIZE;) {
+		if (image[i] == old_image[i]) {
+			i++;
+			continue;
+		}
+
+		size_t start = i;
+		size_t end = i + 1;
+		for (i++; i < IMAGE_SIZE && i < end + PATCH_GAP; i++) {
+			if (image[i] != old_image[i])
+				end = i + 1;
+		}
+
+		if (send_patch(fd, addr, image, start, end))
+			return -1;
+		n_bytes += end - start;
+	}
+
+	return n_bytes;
+}
+
+int watch_main(const vector<string> &inputs, const string &of_name, const string &sock_path)
+{
+	vector<watched_file> files;
+	vector<unsigned char> image(IMAGE_MAX);
+	vector<unsigned char> old_image(IMAGE_MAX);
+	long size;
+
+	int ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0) {
+		perror("inotify_init1");
+		return 1;
+	}
+
+	/* Editors often replace files by renaming, so watch the directories */
+	unordered_map<int, string> wd_dirs;
+	for (const string &path : inputs) {
+		watched_file f;
+		size_t slash = path.rfind('/');
+
+		f.path = path;
+		f.dir = slash == string::npos ? "." : path.substr(0, slash);
+		f.base = slash == string::npos ? path : path.substr(slash + 1);
+
+		int wd = inotify_add_watch(ifd, f.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0) {
+			perror(f.dir.c_str());
+			return 1;
+		}
+
+		wd_dirs[wd] = f.dir;
+		files.push_back(std::move(f));
+	}
+
+	for (watched_file &f : files) {
+		if (update_file(f) < 0)
+			return 1;
+	}
+
+	if (relink(files, image, size))
+		return 1;
+
+	ofstream(of_name, std::ios::binary).write((const char *)image.data(), size);
+	old_image = image;
+
+	sockaddr_un addr = {};
+	int sfd = -1;
+	if (!sock_path.empty()) {
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, sock_path.c_str(), sizeof(addr.sun_path) - 1);
+		sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (sfd < 0) {
+			perror("socket");
+			return 1;
+		}
+	}
+
+	cerr << "Watching " << files.size() << " file(s)" << endl;
+
+	alignas(inotify_event) char buf[4096];
+	for (;;) {
+		ssize_t n = read(ifd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("inotify");
+			return 1;
+		}
+
+		auto t0 = std::chrono::steady_clock::now();
+		bool changed = false;
+
+		for (char *p = buf; p < buf + n; p += sizeof(inotify_event) + ((inotify_event *)p)->len) {
+			inotify_event *ev = (inotify_event *)p;
+			if (!ev->len)
+				continue;
+
+			for (watched_file &f : files) {
+				if (f.dir == wd_dirs[ev->wd] && f.base == ev->name)
+					changed |= update_file(f) > 0;
+			}
+		}
+
+		if (!changed || relink(files, image, size))
+			continue;
+
+		ofstream(of_name, std::ios::binary).write((const char *)image.data(), size);
+
+		long n_bytes = sfd >= 0 ? send_diff(sfd, addr, old_image, image) : 0;
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0);
+
+		/* Keep what the emulator last got, so the next change resends this one */
+		if (n_bytes < 0) {
+			cerr << "Reassembled in " << us.count() << "us, patch not sent" << endl;
+			continue;
+		}
+
+		old_image = image;
+		cerr << "Reassembled in " << us.count() << "us, patched " << n_bytes << " byte(s)" << endl;
+	}
+}
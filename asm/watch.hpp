@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#pragma once
+
+#include "common.hpp"
+
+/*
+ * Watch @inputs and reassemble on every save, writing the image to
+ * @of_name and, if @sock_path is set, sending the changed ranges to a
+ * running emulator. Does not return on success.
+ */
+int watch_main(const vector<string> &inputs, const string &of_name, const string &sock_path);
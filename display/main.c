@@ -1,6 +1,14 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <SDL2/SDL.h>
+#include "../em/video.h"
 
 #ifndef WINDOW_WIDTH
 #define WINDOW_WIDTH 640
@@ -9,30 +17,157 @@
 #define WINDOW_HEIGHT 480
 #endif
 
+#define MAX_TILES 1024
+#define REOPEN_FRAMES 60 // look for instances that are not up yet once a second
+#define IDLE_MS 16
+
 // NOTE: FORCED SCREEN SIZE
-const uint16_t SCREEN_WIDTH = 64;
-const uint16_t SCREEN_HEIGHT = 32;
+const uint16_t SCREEN_WIDTH = VIDEO_WIDTH;
+const uint16_t SCREEN_HEIGHT = VIDEO_HEIGHT;
+
+// One emulator instance and its place in the atlas
+struct tile {
+    char name[32];
+    struct video_hdr *hdr;
+    uint32_t generation; // last one uploaded
+    int x, y;
+};
+
+// Framebuffer exported by em.bin -V or -v n, or NULL until the emulator is up
+static struct video_hdr *video_open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    void *p = mmap(NULL, VIDEO_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    struct video_hdr *hdr = p;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != VIDEO_MAGIC) {
+        munmap(p, VIDEO_SHM_SIZE);
+        return NULL;
+    }
+
+    return hdr;
+}
+
+// Upload the whole frame of an instance that just came up
+static void video_attach(struct tile *tile, SDL_Texture *atlas) {
+    tile->generation = __atomic_load_n(&tile->hdr->generation, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&tile->hdr->dirty, 0, __ATOMIC_SEQ_CST);
+
+    SDL_Rect rect = { tile->x, tile->y, SCREEN_WIDTH, SCREEN_HEIGHT };
+    SDL_UpdateTexture(atlas, &rect, (const uint8_t *)tile->hdr + VIDEO_PIXELS_OFFSET, VIDEO_PITCH);
+}
+
+// Upload the rows the emulator marked dirty, one rect per run of rows.
+// Returns false without touching the atlas if the generation did not move.
+static bool video_update(struct tile *tile, SDL_Texture *atlas) {
+    uint32_t generation = __atomic_load_n(&tile->hdr->generation, __ATOMIC_ACQUIRE);
+    if (generation == tile->generation)
+        return false;
+    tile->generation = generation;
+
+    uint32_t dirty = __atomic_exchange_n(&tile->hdr->dirty, 0, __ATOMIC_SEQ_CST);
+    const uint8_t *pixels = (const uint8_t *)tile->hdr + VIDEO_PIXELS_OFFSET;
+
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        if (!(dirty & (1u << row)))
+            continue;
+
+        int end = row;
+        while (end + 1 < SCREEN_HEIGHT && (dirty & (1u << (end + 1))))
+            end++;
+
+        SDL_Rect rect = { tile->x, tile->y + row, SCREEN_WIDTH, end - row + 1 };
+        SDL_UpdateTexture(atlas, &rect, pixels + row * VIDEO_PITCH, VIDEO_PITCH);
+        row = end;
+    }
+
+    return dirty != 0;
+}
 
+// display             the instance of em.bin -V
+// display -t N        instances 0..N-1 (em.bin -v n), tiled
+// display name...     the given shared memory objects, tiled
 int main(int argc, char *argv[]) {
+    static struct tile tiles[MAX_TILES];
+    int count = 0;
+
+    if (argc == 3 && !strcmp(argv[1], "-t")) {
+        int n = atoi(argv[2]);
+        for (count = 0; count < n && count < MAX_TILES; count++)
+            snprintf(tiles[count].name, sizeof(tiles[count].name), VIDEO_SHM_INSTANCE, count);
+    } else if (argc > 1) {
+        for (count = 0; count < argc - 1 && count < MAX_TILES; count++)
+            snprintf(tiles[count].name, sizeof(tiles[count].name), "%s", argv[count + 1]);
+    } else {
+        snprintf(tiles[count++].name, sizeof(tiles[0].name), "%s", VIDEO_SHM_NAME);
+    }
+    if (!count) {
+        fprintf(stderr, "usage: %s [-t count | name...]\n", argv[0]);
+        return 1;
+    }
+
+    // Square-ish grid. The atlas is drawn flipped, so the tile rows are
+    // stored bottom-up to come out in order on screen.
+    int cols = (int)ceil(sqrt(count));
+    int rows = (count + cols - 1) / cols;
+    for (int i = 0; i < count; i++) {
+        tiles[i].x = i % cols * SCREEN_WIDTH;
+        tiles[i].y = (rows - 1 - i / cols) * SCREEN_HEIGHT;
+    }
+
     SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("Hello World!", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
-    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
-    uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT]; // dont give it data for cool effect
+    SDL_Window *window = SDL_CreateWindow("msc16", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    SDL_Texture *atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, cols * SCREEN_WIDTH, rows * SCREEN_HEIGHT);
+    // Black until an instance comes up
+    uint16_t *blank = calloc((size_t)cols * SCREEN_WIDTH * rows * SCREEN_HEIGHT, sizeof(*blank));
+    SDL_UpdateTexture(atlas, NULL, blank, cols * SCREEN_WIDTH * sizeof(*blank));
+    free(blank);
+
     bool running = true;
+    bool redraw = true;
+    bool busy = false;
+    unsigned frame = 0;
     while (running != false) {
+        // Sleep in here while no instance draws, instead of spinning
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            if (event.type == SDL_QUIT) {
-                running = false;
-                goto end;
+        if (SDL_WaitEventTimeout(&event, busy ? 0 : IDLE_MS)) {
+            do {
+                if (event.type == SDL_QUIT) {
+                    running = false;
+                    goto end;
+                }
+                if (event.type == SDL_WINDOWEVENT)
+                    redraw = true;
+            } while (SDL_PollEvent(&event));
+        }
+
+        busy = false;
+        for (int i = 0; i < count; i++) {
+            struct tile *tile = &tiles[i];
+
+            if (!tile->hdr && frame % REOPEN_FRAMES == 0 && (tile->hdr = video_open(tile->name))) {
+                video_attach(tile, atlas);
+                busy = true;
+            } else if (tile->hdr && video_update(tile, atlas)) {
+                busy = true;
             }
         }
+        frame++;
+
+        if (!busy && !redraw)
+            continue;
+        redraw = false;
 
-        SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
+        SDL_RenderClear(renderer);
         SDL_RenderCopyEx(
             renderer,
-            texture,
+            atlas,
             NULL,
             NULL,
             0.0,
@@ -42,10 +177,13 @@ int main(int argc, char *argv[]) {
     }
 end:
 
-    SDL_DestroyTexture(texture);
+    for (int i = 0; i < count; i++) {
+        if (tiles[i].hdr)
+            munmap(tiles[i].hdr, VIDEO_SHM_SIZE);
+    }
+    SDL_DestroyTexture(atlas);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
 }
-
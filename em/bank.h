@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Bank geometry, shared by the emulator's mapper and the assembler's .bank */
+#ifndef _BANK_H_
+#define _BANK_H_
+
+#define BANK_SIZE 0x4000
+#define BANK_WINDOWS 2
+#define BANK_WINDOW(n) (0x4000 + (n) * BANK_SIZE) /* $4000, $8000 */
+
+#endif /* _BANK_H_ */
@@ -1,12 +1,20 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
+#include <string.h>
 #include "opcodes.h"
 #include "bus.h"
+#include "dev.h"
+#include "fuse.h"
 
 u16 cpu_bus_read(cpu_t *cpu, busptr_t *ptr)
 {
 	if (ptr->type == BUS_MEM) {
-		u8 *mem = (u8 *)&cpu->memory[ptr->reg_mem_addr];
-		u16 ret = mem[0] | (mem[1] << 8);
+		u16 addr = ptr->reg_mem_addr;
+		device_t *dev = dev_map[addr >> 8];
+
+		if (unlikely(dev) && dev->read && dev_claims(dev, addr))
+			return dev_read(dev, cpu, addr);
+
+		u16 ret = cpu->memory[addr] | (cpu->memory[(u16)(addr + 1)] << 8);
 		return ret;
 	} else {
 		return CPU_REG_READ(cpu, ptr->reg_mem_addr);
@@ -16,11 +24,71 @@ u16 cpu_bus_read(cpu_t *cpu, busptr_t *ptr)
 void cpu_bus_write(cpu_t *cpu, busptr_t *ptr, u16 value)
 {
 	if (ptr->type == BUS_MEM) {
-		u8 *mem = (u8 *)&cpu->memory[ptr->reg_mem_addr];
-		mem[0] = value & 0xFF;
-		mem[1] = (value >> 8) & 0xFF;
+		u16 addr = ptr->reg_mem_addr;
+		device_t *dev = dev_map[addr >> 8];
+
+		if (unlikely(dev) && dev->write && dev_claims(dev, addr)) {
+			dev->write(dev, cpu, addr, value);
+			return;
+		}
+
+		cpu->memory[addr] = value & 0xFF;
+		cpu->memory[(u16)(addr + 1)] = (value >> 8) & 0xFF;
+		fuse_touch(addr, 2);
 	} else {
 		CPU_REG_WRITE(cpu, ptr->reg_mem_addr, value);
 	}
 }
 
+void cpu_mem_patch(cpu_t *cpu, u16 addr, const u8 *buf, u16 len)
+{
+	for (u16 i = 0; i < len; i++)
+		cpu->memory[(u16)(addr + i)] = buf[i];
+
+	dev_touch(addr, len);
+	fuse_touch(addr, len);
+}
+
+/* Copy @n words from @src to @dst upwards, one word at a time */
+void cpu_mem_copy(cpu_t *cpu, u16 dst, u16 src, u16 n)
+{
+	u32 len = n * 2;
+
+	/* Same result as the word loop unless the copy wraps or runs into itself */
+	if (dst + len <= MEM_SIZE && src + len <= MEM_SIZE && (dst == src || (u16)(dst - src) >= len)) {
+		memmove(&cpu->memory[dst], &cpu->memory[src], len);
+	} else {
+		for (u32 i = 0; i < len; i += 2) {
+			cpu->memory[(u16)(dst + i)] = cpu->memory[(u16)(src + i)];
+			cpu->memory[(u16)(dst + i + 1)] = cpu->memory[(u16)(src + i + 1)];
+		}
+	}
+
+	dev_touch(dst, len);
+	fuse_touch(dst, len);
+}
+
+/* Store @val into @n words at @dst */
+void cpu_mem_fill(cpu_t *cpu, u16 dst, u16 val, u16 n)
+{
+	u32 len = n * 2;
+	u8 *p = &cpu->memory[dst];
+
+	if (dst + len > MEM_SIZE) {
+		for (u32 i = 0; i < len; i += 2) {
+			cpu->memory[(u16)(dst + i)] = val & 0xFF;
+			cpu->memory[(u16)(dst + i + 1)] = val >> 8;
+		}
+	} else if ((val & 0xFF) == val >> 8) {
+		memset(p, val & 0xFF, len);
+	} else if (len) {
+		/* Double the filled prefix until it covers the range */
+		p[0] = val & 0xFF;
+		p[1] = val >> 8;
+		for (u32 done = 2; done < len; done *= 2)
+			memcpy(p + done, p, done < len - done ? done : len - done);
+	}
+
+	dev_touch(dst, len);
+	fuse_touch(dst, len);
+}
@@ -19,7 +19,17 @@ typedef struct _busptr {
 
 u16 cpu_bus_read(cpu_t *cpu, busptr_t *ptr);
 void cpu_bus_write(cpu_t *cpu, busptr_t *ptr, u16 value);
+void cpu_mem_patch(cpu_t *cpu, u16 addr, const u8 *buf, u16 len);
+void cpu_mem_copy(cpu_t *cpu, u16 dst, u16 src, u16 n);
+void cpu_mem_fill(cpu_t *cpu, u16 dst, u16 val, u16 n);
 void cpu_advance(cpu_t *cpu);
-void cpu_init(cpu_t *cpu);
+/* CPU_FEAT_* an extended instruction needs, by the RRRR field of its CMP */
+extern const u16 cpu_ext_feature[16];
+int cpu_init(cpu_t *cpu);
+/* Like cpu_init(), with memory from @alloc; see mem.h */
+int cpu_init_mem(cpu_t *cpu, const struct mem_alloc *alloc, const char *arg);
+/* Reset @cpu to run on @memory owned by another core; do not cpu_free() it */
+void cpu_init_shared(cpu_t *cpu, u8 *memory);
+void cpu_free(cpu_t *cpu);
 
 #endif /* _BUS_H_ */
@@ -1,39 +1,55 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
-#include <stdio.h>
 #include "opcodes.h"
 #include "bus.h"
-
-#define likely(x) (__builtin_expect(!!(x), 1))
+#include "dev.h"
+#include "fuse.h"
+#include "mem.h"
+#include "trace.h"
 
 #define OPC_R1(opc) ((opc >> 6) & 0x3)
 #define OPC_R2(opc) ((opc >> 4) & 0x3)
+#define OPC_EXT(opc) ((opc >> 8) & 0xF)
 
-#define GEN_ARITH_INST(name, op, write)                                                             \
+#define GEN_ARITH_INST(name, op, write, flagop)                                                     \
 	u16 inst_##name(cpu_t *cpu, busptr_t *r1, busptr_t *r2)                                     \
 	{                                                                                           \
-		printf(#name " %c %c\n", 'A' + cpu_bus_read(cpu, r1), 'A' + cpu_bus_read(cpu, r2)); \
 		u16 t1 = cpu_bus_read(cpu, r1);                                                     \
 		u16 t2 = cpu_bus_read(cpu, r2);                                                     \
 		u16 result = t1 op t2;                                                              \
+		if (flagop != FLAGOP_LOGIC) {                                                       \
+			cpu->lf_a = t1;                                                             \
+			cpu->lf_b = t2;                                                             \
+		}                                                                                   \
 		if (likely(write))                                                                  \
 			cpu_bus_write(cpu, r1, result);                                             \
 		return result;                                                                      \
 	}
 
-GEN_ARITH_INST(add, +, 1);
-GEN_ARITH_INST(sub, -, 1);
-GEN_ARITH_INST(cmp, -, 0);
-GEN_ARITH_INST(and, &, 1);
-GEN_ARITH_INST(or, |, 1);
-GEN_ARITH_INST(xor, ^, 1);
-GEN_ARITH_INST(lsh, <<, 1);
-GEN_ARITH_INST(rsh, >>, 1);
+GEN_ARITH_INST(add, +, 1, FLAGOP_ADD);
+GEN_ARITH_INST(sub, -, 1, FLAGOP_SUB);
+GEN_ARITH_INST(cmp, -, 0, FLAGOP_SUB);
+GEN_ARITH_INST(and, &, 1, FLAGOP_LOGIC);
+GEN_ARITH_INST(or, |, 1, FLAGOP_LOGIC);
+GEN_ARITH_INST(xor, ^, 1, FLAGOP_LOGIC);
+GEN_ARITH_INST(lsh, <<, 1, FLAGOP_LSH);
+GEN_ARITH_INST(rsh, >>, 1, FLAGOP_LOGIC);
+
+/* AFL-style edge coverage, recorded on every taken branch */
+static inline void cpu_cov_edge(cpu_t *cpu, u16 dst)
+{
+	if (likely(!cpu->cov_map))
+		return;
+
+	u16 cur = ((dst >> 1) * 0x9E3779B1u) >> 16;
+	cpu->cov_map[cur ^ cpu->cov_prev]++;
+	cpu->cov_prev = cur >> 1;
+}
 
 u16 inst_jnz(cpu_t *cpu, busptr_t *r1, busptr_t *r2)
 {
-	printf("jnz %d\n", cpu_bus_read(cpu, r1));
 	if (!TEST_FLAG(cpu, FLAG_Z)) {
 		cpu->ip = cpu_bus_read(cpu, r1);
+		cpu_cov_edge(cpu, cpu->ip);
 	}
 
 	return 0;
@@ -41,7 +57,6 @@ u16 inst_jnz(cpu_t *cpu, busptr_t *r1, busptr_t *r2)
 
 u16 inst_push(cpu_t *cpu, busptr_t *r1)
 {
-	printf("push %c\n", 'a' + cpu_bus_read(cpu, r1));
 	cpu->sp -= 2;
 	u16 rval = cpu_bus_read(cpu, r1);
 
@@ -53,7 +68,6 @@ u16 inst_push(cpu_t *cpu, busptr_t *r1)
 
 u16 inst_pop(cpu_t *cpu, busptr_t *r1)
 {
-	printf("pop %c\n", 'a' + cpu_bus_read(cpu, r1));
 	busptr_t sp = { .reg_mem_addr = cpu->sp, .type = BUS_MEM };
 	u16 val = cpu_bus_read(cpu, &sp);
 	cpu_bus_write(cpu, r1, val);
@@ -65,7 +79,6 @@ u16 inst_pop(cpu_t *cpu, busptr_t *r1)
 
 u16 inst_st_ld(cpu_t *cpu, busptr_t *r1, busptr_t *r2)
 {
-	printf("st/ld %4x %4x\n", cpu_bus_read(cpu, r1), cpu_bus_read(cpu, r2));
 	u16 t1 = cpu_bus_read(cpu, r2);
 	cpu_bus_write(cpu, r1, t1);
 	return t1;
@@ -73,46 +86,146 @@ u16 inst_st_ld(cpu_t *cpu, busptr_t *r1, busptr_t *r2)
 
 u16 inst_cli(cpu_t *cpu)
 {
-	printf("cli\n");
 	CLEAR_FLAG(cpu, FLAG_I);
 	return 0;
 }
 
 u16 inst_sti(cpu_t *cpu)
 {
-	printf("sti\n");
 	SET_FLAG(cpu, FLAG_I);
+	/* Deliver interrupts that were held off */
+	__atomic_store_n(&cpu->next_event, 0, __ATOMIC_RELAXED);
 	return 0;
 }
 
 u16 inst_int(cpu_t *cpu, busptr_t *r1, busptr_t *r2)
 {
-	printf("int %d\n", cpu_bus_read(cpu, r1));
-	if (TEST_FLAG(cpu, FLAG_I))
+	if (TEST_FLAG(cpu, FLAG_I)) {
 		cpu->ip = cpu_bus_read(cpu, r1);
+		cpu_cov_edge(cpu, cpu->ip);
+	}
 
 	return 0;
 }
 
+/* Feature bit each extended instruction needs; 0 keeps plain CMP */
+const u16 cpu_ext_feature[16] = {
+	[EXT_XCHG] = CPU_FEAT_ATOMIC,
+	[EXT_CAS] = CPU_FEAT_ATOMIC,
+	[EXT_MUL] = CPU_FEAT_BLOCK,
+	[EXT_MOVS] = CPU_FEAT_BLOCK,
+	[EXT_FILL] = CPU_FEAT_BLOCK,
+};
+
+/*
+ * Atomics operate on the aligned word at (R2) with host atomics, so they stay
+ * atomic when other cores share the memory. Guest words are little-endian,
+ * like the host. On device pages they are plain bus accesses instead.
+ */
+static void cpu_advance_ext(cpu_t *cpu, u16 opcode)
+{
+	u16 *r1 = &cpu->r[OPC_R1(opcode)];
+	busptr_t m = { .reg_mem_addr = cpu->r[OPC_R2(opcode)] & ~1, .type = BUS_MEM };
+	u16 *mem = (u16 *)&cpu->memory[m.reg_mem_addr];
+	int io = dev_map[m.reg_mem_addr >> 8] != NULL;
+
+	switch (OPC_EXT(opcode)) {
+	case EXT_XCHG:
+		if (unlikely(io)) {
+			u16 old = cpu_bus_read(cpu, &m);
+			cpu_bus_write(cpu, &m, *r1);
+			*r1 = old;
+		} else {
+			*r1 = __atomic_exchange_n(mem, *r1, __ATOMIC_SEQ_CST);
+			fuse_touch(m.reg_mem_addr, 2);
+		}
+		SET_RESULT(cpu, FLAGOP_LOGIC, *r1);
+		break;
+	case EXT_CAS: {
+		/* if ((R2) == A) (R2) = R1; A = old (R2); flags as CMP old A */
+		u16 expected = cpu->a;
+		u16 old = expected;
+
+		if (unlikely(io)) {
+			old = cpu_bus_read(cpu, &m);
+			if (old == expected)
+				cpu_bus_write(cpu, &m, *r1);
+		} else {
+			if (__atomic_compare_exchange_n(mem, &old, *r1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				fuse_touch(m.reg_mem_addr, 2);
+		}
+		cpu->a = old;
+		cpu->lf_a = old;
+		cpu->lf_b = expected;
+		SET_RESULT(cpu, FLAGOP_SUB, old - expected);
+		break;
+	}
+	case EXT_MUL: {
+		u16 t1 = *r1;
+		u16 t2 = cpu->r[OPC_R2(opcode)];
+
+		*r1 = t1 * t2;
+		cpu->lf_a = t1;
+		cpu->lf_b = t2;
+		SET_RESULT(cpu, FLAGOP_MUL, *r1);
+		break;
+	}
+	case EXT_MOVS:
+		/* C words from (A) to (B); A and B end past the blocks, C at 0 */
+		cpu_mem_copy(cpu, cpu->b, cpu->a, cpu->c);
+		cpu->a += cpu->c * 2;
+		cpu->b += cpu->c * 2;
+		cpu->c = 0;
+		SET_RESULT(cpu, FLAGOP_LOGIC, 0);
+		break;
+	case EXT_FILL:
+		/* A into C words at (B); B ends past the block, C at 0 */
+		cpu_mem_fill(cpu, cpu->b, cpu->a, cpu->c);
+		cpu->b += cpu->c * 2;
+		cpu->c = 0;
+		SET_RESULT(cpu, FLAGOP_LOGIC, 0);
+		break;
+	default:
+		break;
+	}
+
+	IP_ADVANCE(cpu, 2);
+}
+
 void cpu_advance(cpu_t *cpu)
 {
 	static const int n_inst = 16;
 	static void *inst_select[] = { inst_cmp, inst_add, inst_sub, inst_jnz, inst_push, inst_pop, inst_st_ld, inst_st_ld,
 				       inst_or,	 inst_and, inst_xor, inst_lsh, inst_rsh,  inst_cli, inst_sti,	inst_int };
+	static const u8 flag_op[] = { [INST_CMP] = FLAGOP_SUB, [INST_ADD] = FLAGOP_ADD, [INST_SUB] = FLAGOP_SUB,
+				      [INST_LSH] = FLAGOP_LSH, [INST_INT] = FLAGOP_LOGIC };
+
+	if (unlikely(cpu->cycles >= __atomic_load_n(&cpu->next_event, __ATOMIC_RELAXED)))
+		dev_service(cpu);
 
 	u16 ip = cpu->ip;
 	busptr_t r1 = { .reg_mem_addr = ip, .type = BUS_MEM };
+
+	cpu->cycles++;
 	busptr_t r2;
 
 	u16 opcode = cpu_bus_read(cpu, &r1);
 	u16 inst = opcode >> 12;
 	u16 admode = (opcode & 0x8) >> 3;
 
+	if (unlikely(cpu->trace))
+		trace_insn(cpu, ip, opcode);
+
 	if (inst >= n_inst) {
 		IP_ADVANCE(cpu, 1);
 		return;
 	}
 
+	if (unlikely(inst == INST_CMP && (cpu->features & cpu_ext_feature[OPC_EXT(opcode)]))) {
+		cpu_advance_ext(cpu, opcode);
+		return;
+	}
+
 	r1 = (busptr_t){ 0 };
 	r2 = (busptr_t){ 0 };
 
@@ -179,16 +292,10 @@ void cpu_advance(cpu_t *cpu)
 	}
 
 	u16 (*inst_func)(cpu_t *, busptr_t *, busptr_t *) = inst_select[inst];
-	printf("ip: %4x opcode: %4x: ", ip, opcode);
 	u16 ip_cur = cpu->ip;
 	u16 result = inst_func(cpu, &r1, &r2);
 
-	INVALIDATE_FLAGS(cpu);
-
-	if (result == 0)
-		SET_FLAG(cpu, FLAG_Z);
-	if (result & 0x8000)
-		SET_FLAG(cpu, FLAG_N);
+	SET_RESULT(cpu, flag_op[inst], result);
 
 	if (cpu->ip == ip_cur) {
 		if (admode) {
@@ -199,9 +306,47 @@ void cpu_advance(cpu_t *cpu)
 	}
 }
 
-void cpu_init(cpu_t *cpu)
+void cpu_init_shared(cpu_t *cpu, u8 *memory)
 {
+	cpu->memory = memory;
+	cpu->r64 = 0;
 	cpu->ip = 0;
 	cpu->sp = 0x1000;
 	cpu->flags = 0;
+	SET_RESULT(cpu, FLAGOP_LOGIC, 1);
+	cpu->cycles = 0;
+	cpu->next_event = DEV_NEVER;
+	cpu->trace = 1;
+	cpu->cov_map = NULL;
+	cpu->cov_prev = 0;
+	cpu->features = 0;
+	cpu->alloc = NULL;
+}
+
+int cpu_init_mem(cpu_t *cpu, const mem_alloc_t *alloc, const char *arg)
+{
+	u8 *memory = alloc->alloc(arg);
+
+	if (!memory) {
+		cpu->memory = NULL;
+		return -1;
+	}
+
+	cpu_init_shared(cpu, memory);
+	cpu->alloc = alloc;
+
+	return 0;
+}
+
+int cpu_init(cpu_t *cpu)
+{
+	/* mmap()ed so that pages can be protected individually */
+	return cpu_init_mem(cpu, &mem_anon, NULL);
+}
+
+void cpu_free(cpu_t *cpu)
+{
+	if (cpu->memory && cpu->alloc)
+		cpu->alloc->free(cpu->memory);
+	cpu->memory = NULL;
 }
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <string.h>
+#include "bus.h"
+#include "dev.h"
+#include "replay.h"
+
+device_t *dev_map[MEM_SIZE >> 8];
+
+static device_t *devices[DEV_MAX];
+static int n_devices;
+
+int dev_register(device_t *dev)
+{
+	u32 first = dev->base >> 8;
+	u32 last = (dev->base + dev->size - 1) >> 8;
+
+	if (n_devices == DEV_MAX || !dev->size || dev->base + dev->size > MEM_SIZE)
+		return -1;
+
+	for (u32 page = first; page <= last; page++) {
+		if (dev_map[page])
+			return -1;
+	}
+
+	for (u32 page = first; page <= last; page++)
+		dev_map[page] = dev;
+
+	dev->event_at = DEV_NEVER;
+	dev->irq_pending = 0;
+	devices[n_devices++] = dev;
+
+	return 0;
+}
+
+/* Make @cpu call dev_service() no later than cycle @when */
+static void dev_kick(cpu_t *cpu, u64 when)
+{
+	u64 cur = __atomic_load_n(&cpu->next_event, __ATOMIC_RELAXED);
+
+	while (when < cur &&
+	       !__atomic_compare_exchange_n(&cpu->next_event, &cur, when, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+}
+
+void dev_schedule(device_t *dev, cpu_t *cpu, u64 when)
+{
+	dev->event_cpu = cpu;
+	dev->event_at = when;
+	dev_kick(cpu, when);
+}
+
+void dev_raise_irq(device_t *dev, cpu_t *cpu, u16 vector)
+{
+	dev->irq_cpu = cpu;
+	dev->irq_vector = vector;
+	__atomic_store_n(&dev->irq_pending, 1, __ATOMIC_RELEASE);
+	dev_kick(cpu, 0);
+}
+
+void dev_touch(u16 addr, u32 len)
+{
+	if (likely(!n_devices))
+		return;
+
+	while (len) {
+		device_t *dev = dev_map[addr >> 8];
+		u32 chunk = 0x100 - (addr & 0xFF);
+
+		if (chunk > len)
+			chunk = len;
+		if (dev && dev->touch)
+			dev->touch(dev, addr, chunk);
+
+		addr += chunk;
+		len -= chunk;
+	}
+}
+
+u16 dev_read(device_t *dev, cpu_t *cpu, u16 addr)
+{
+	if (likely(!replay_mode))
+		return dev->read(dev, cpu, addr);
+
+	/* Replay hands back what the device returned when recording */
+	return replay_read(cpu, addr, replay_mode == REPLAY_RECORD ? dev->read(dev, cpu, addr) : 0);
+}
+
+void dev_deliver(cpu_t *cpu, u16 vector)
+{
+	busptr_t sp;
+
+	if (replay_mode == REPLAY_RECORD)
+		replay_irq(cpu, vector);
+
+	cpu->sp -= 2;
+	sp = (busptr_t){ .reg_mem_addr = cpu->sp, .type = BUS_MEM };
+	cpu_bus_write(cpu, &sp, cpu->ip);
+
+	CLEAR_FLAG(cpu, FLAG_I);
+	cpu->ip = vector;
+}
+
+void dev_run_event(cpu_t *cpu, int i)
+{
+	device_t *dev;
+
+	if (i >= n_devices || !devices[i]->event)
+		return;
+
+	dev = devices[i];
+
+	if (replay_mode == REPLAY_RECORD)
+		replay_event(cpu, i);
+
+	dev->event_at = DEV_NEVER;
+	dev->event(dev, cpu);
+}
+
+void dev_service(cpu_t *cpu)
+{
+	u64 next = DEV_NEVER;
+
+	/* Kicks from here on lower next_event again, so none are lost */
+	__atomic_exchange_n(&cpu->next_event, DEV_NEVER, __ATOMIC_SEQ_CST);
+
+	/* Checkpoints first, so they hold what the cycle started from */
+	if (unlikely(replay_mode)) {
+		next = replay_service(cpu);
+		/* Events and interrupts come from the log */
+		if (replay_mode == REPLAY_PLAY) {
+			dev_kick(cpu, next);
+			return;
+		}
+	}
+
+	for (int i = 0; i < n_devices; i++) {
+		device_t *dev = devices[i];
+
+		if (dev->event_cpu == cpu && dev->event_at <= cpu->cycles)
+			dev_run_event(cpu, i);
+	}
+
+	for (int i = 0; i < n_devices; i++) {
+		device_t *dev = devices[i];
+
+		if (dev->event_cpu == cpu && dev->event_at < next)
+			next = dev->event_at;
+	}
+
+	for (int i = 0; i < n_devices && (cpu->flags & FLAG_I); i++) {
+		device_t *dev = devices[i];
+
+		if (__atomic_load_n(&dev->irq_pending, __ATOMIC_ACQUIRE) && dev->irq_cpu == cpu) {
+			__atomic_store_n(&dev->irq_pending, 0, __ATOMIC_RELAXED);
+			dev_deliver(cpu, dev->irq_vector);
+		}
+	}
+
+	dev_kick(cpu, next);
+}
+
+/* Scheduling state dev.c keeps for each device, saved ahead of its own */
+struct dev_sched {
+	u64 event_at;
+	u16 irq_vector;
+	u16 irq_pending;
+};
+
+size_t dev_state_size(void)
+{
+	size_t size = 0;
+
+	for (int i = 0; i < n_devices; i++)
+		size += sizeof(struct dev_sched) + devices[i]->state_size;
+
+	return size;
+}
+
+size_t dev_save(u8 *buf)
+{
+	u8 *start = buf;
+
+	for (int i = 0; i < n_devices; i++) {
+		device_t *dev = devices[i];
+		struct dev_sched sched = {
+			.event_at = dev->event_at,
+			.irq_vector = dev->irq_vector,
+			.irq_pending = __atomic_load_n(&dev->irq_pending, __ATOMIC_ACQUIRE),
+		};
+
+		memcpy(buf, &sched, sizeof(sched));
+		buf += sizeof(sched);
+
+		if (dev->save)
+			buf += dev->save(dev, buf);
+	}
+
+	return buf - start;
+}
+
+void dev_restore(cpu_t *cpu, const u8 *buf)
+{
+	for (int i = 0; i < n_devices; i++) {
+		device_t *dev = devices[i];
+		struct dev_sched sched;
+
+		memcpy(&sched, buf, sizeof(sched));
+		buf += sizeof(sched);
+
+		if (dev->restore)
+			buf += dev->restore(dev, cpu, buf);
+
+		dev->event_cpu = sched.event_at != DEV_NEVER ? cpu : NULL;
+		dev->event_at = sched.event_at;
+		dev->irq_cpu = sched.irq_pending ? cpu : NULL;
+		dev->irq_vector = sched.irq_vector;
+		__atomic_store_n(&dev->irq_pending, sched.irq_pending, __ATOMIC_RELEASE);
+	}
+
+	/* Let dev_service() pick up the restored events */
+	cpu->next_event = 0;
+}
+
+size_t dev_names(char *buf, size_t size)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; i < n_devices && len < size; i++)
+		len += snprintf(buf + len, size - len, "%s%s", i ? "," : "", devices[i]->name);
+
+	return len < size ? len : size - 1;
+}
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Memory-mapped devices
+ *
+ * A device claims a range of guest addresses. Bus accesses to the range go to
+ * its read/write callbacks; a NULL callback leaves that direction to RAM.
+ * Bulk writes that bypass the bus (MOVS, FILL, DMA, hot patches) are reported
+ * through touch() instead.
+ *
+ * Devices run work at a given cycle through dev_schedule(), and interrupt the
+ * CPU through dev_raise_irq(). Both make the core call dev_service() before
+ * its next instruction; cpu_advance() only compares cycles to next_event.
+ */
+#ifndef _DEV_H_
+#define _DEV_H_
+
+#include <stdio.h>
+#include "bank.h"
+#include "opcodes.h"
+
+#define DEV_MAX 16
+#define DEV_NEVER (~0ULL)
+
+/* Built-in device registers */
+#define DMA_BASE 0xFE00
+#define DMA_SRC 0x0
+#define DMA_DST 0x2
+#define DMA_LEN 0x4 /* words */
+#define DMA_CTRL 0x6
+#define DMA_VEC 0x8 /* completion interrupt vector */
+
+#define DMA_CTRL_START 0x0001 /* write: start a transfer */
+#define DMA_CTRL_IRQ 0x0002 /* interrupt on completion */
+#define DMA_CTRL_BUSY 0x8000 /* read: transfer in progress */
+
+#define UART_BASE 0xFD00
+#define UART_RX 0x0 /* read: next received byte */
+#define UART_TX 0x2 /* write: send a byte */
+#define UART_STATUS 0x4
+#define UART_CTRL 0x6
+#define UART_VEC 0x8 /* receive interrupt vector */
+#define UART_TX_ADDR 0xA
+#define UART_TX_LEN 0xC /* write: send LEN bytes from TX_ADDR; read: bytes queued */
+
+#define UART_STATUS_RX 0x0001 /* a received byte is available */
+#define UART_STATUS_TX_FULL 0x0002 /* the transmit ring is full */
+#define UART_STATUS_OVERRUN 0x0004 /* bytes were dropped; cleared on read */
+#define UART_CTRL_RX_IRQ 0x0001 /* interrupt while received bytes are available */
+
+#define MAPPER_BASE 0xFC00
+#define MAPPER_BANK0 0x0 /* bank shown in window 0 */
+#define MAPPER_BANK1 0x2 /* bank shown in window 1 */
+#define MAPPER_NBANKS 0x4 /* read: banks in the store */
+#define MAPPER_HOME 0xFFFF /* bank number: the window's own RAM */
+
+#define WARM_BASE 0xFB00
+#define WARM_DONE 0x0 /* write WARM_MAGIC: initialization is done */
+#define WARM_MAGIC 0xB007
+
+typedef struct device device_t;
+
+struct device {
+	const char *name;
+	u16 base;
+	u16 size;
+
+	u16 (*read)(device_t *dev, cpu_t *cpu, u16 addr);
+	void (*write)(device_t *dev, cpu_t *cpu, u16 addr, u16 value);
+	void (*touch)(device_t *dev, u16 addr, u32 len);
+	void (*event)(device_t *dev, cpu_t *cpu);
+
+	/* Its pages of guest memory are a host mapping that must stay in place */
+	int mapped;
+
+	/*
+	 * Up to state_size bytes of state that checkpoints and warm images
+	 * carry; save() returns the bytes it wrote, restore() those it read
+	 */
+	size_t state_size;
+	size_t (*save)(device_t *dev, u8 *buf);
+	size_t (*restore)(device_t *dev, cpu_t *cpu, const u8 *buf);
+
+	/* Owned by dev.c */
+	cpu_t *event_cpu;
+	u64 event_at;
+	cpu_t *irq_cpu;
+	u16 irq_vector;
+	int irq_pending;
+};
+
+/* Device claiming each 256-byte guest page, or NULL */
+extern device_t *dev_map[MEM_SIZE >> 8];
+
+static inline int dev_claims(const device_t *dev, u16 addr)
+{
+	return (u16)(addr - dev->base) < dev->size;
+}
+
+int dev_register(device_t *dev);
+/* Run @dev's event callback on @cpu once it reaches cycle @when */
+void dev_schedule(device_t *dev, cpu_t *cpu, u64 when);
+/* Interrupt @cpu at @vector; safe to call from other threads */
+void dev_raise_irq(device_t *dev, cpu_t *cpu, u16 vector);
+/* RAM in [addr, addr + len) was written behind the bus */
+void dev_touch(u16 addr, u32 len);
+/* Run due events and deliver pending interrupts */
+void dev_service(cpu_t *cpu);
+/* Bus read of a device register */
+u16 dev_read(device_t *dev, cpu_t *cpu, u16 addr);
+
+/* For replay: push ip and jump to @vector with interrupts disabled */
+void dev_deliver(cpu_t *cpu, u16 vector);
+/* For replay: run the event of the @i-th registered device now */
+void dev_run_event(cpu_t *cpu, int i);
+/* Device registers, pending events and interrupts, for snapshots */
+size_t dev_state_size(void); /* the most dev_save() writes */
+size_t dev_save(u8 *buf);
+void dev_restore(cpu_t *cpu, const u8 *buf);
+/* Registered device names, comma-separated, in registration order */
+size_t dev_names(char *buf, size_t size);
+
+/* DMA controller at DMA_BASE; a transfer takes 1 + len / @words_per_cycle */
+int dma_init(unsigned int words_per_cycle);
+/* Framebuffer at VIDEO_BASE, exported to the display as @name or the default */
+int video_init(cpu_t *cpu, const char *name);
+/* Bank mapper at MAPPER_BASE over a new store of @spec bytes, or a file */
+int mapper_init(cpu_t *cpu, const char *spec);
+/* Fill the banks from the rest of an image, after the first MEM_SIZE bytes */
+int mapper_load(FILE *fp);
+/* Init-done register at WARM_BASE, which sets warm_request */
+int warm_init(void);
+/* Serial console at UART_BASE on "stdio", a new "pty", or a file or FIFO */
+int uart_init(const char *spec);
+
+#endif /* _DEV_H_ */
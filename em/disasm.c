@@ -0,0 +1,283 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bus.h"
+#include "disasm.h"
+#include "trace.h"
+
+#define NO_OPERAND 0xFF
+#define TRACE_CHUNK (1 << 16) /* records per job in disasm_trace() */
+#define TRACE_THREADS_MAX 64
+
+/* Text with a hole at @operand_at for the operand word, 16 bytes */
+struct disasm_op {
+	char text[12];
+	u8 text_len;
+	u8 operand_at;
+	u8 len;
+	u8 ext; /* CPU_FEAT_* that makes it an ext_ops[] instruction */
+};
+
+static struct disasm_op ops[0x10000];
+/* CMP with an extension, by the RRRR, R1 and R2 fields */
+static struct disasm_op ext_ops[0x100];
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+static const char *const names[16] = { "cmp", "add", "sub", "jnz", "push", "pop", "st",	 "ld",
+				       "or",  "and", "xor", "lsh", "rsh",  "cli", "sti", "int" };
+static const char *const ext_names[16] = {
+	[EXT_XCHG] = "xchg", [EXT_CAS] = "cas", [EXT_MUL] = "mul", [EXT_MOVS] = "movs", [EXT_FILL] = "fill",
+};
+static const char hex[] = "0123456789abcdef";
+
+/* @post follows the operand word, NULL if there is none */
+static void op_set(struct disasm_op *op, int len, const char *pre, const char *post)
+{
+	op->text_len = snprintf(op->text, sizeof(op->text), "%s%s", pre, post ? post : "");
+	op->operand_at = post ? strlen(pre) : NO_OPERAND;
+	op->len = len;
+}
+
+static void ops_build(void)
+{
+	char pre[16], post[8];
+
+	for (u32 opc = 0; opc < 0x10000; opc++) {
+		struct disasm_op *op = &ops[opc];
+		const char *name = names[opc >> 12];
+		char r1 = 'a' + ((opc >> 6) & 0x3);
+		char r2 = 'a' + ((opc >> 4) & 0x3);
+		int imm = opc & 0x8;
+
+		switch (opc >> 12) {
+		case INST_JNZ:
+			snprintf(pre, sizeof(pre), imm ? "jnz $" : "jnz %%%c", r1);
+			op_set(op, imm ? 4 : 2, pre, imm ? "" : NULL);
+			break;
+		case INST_PUSH:
+		case INST_POP:
+			snprintf(pre, sizeof(pre), "%s %%%c", name, r1);
+			op_set(op, imm ? 4 : 2, pre, NULL);
+			break;
+		case INST_ST:
+			/* The operand slot is the destination; ip skips the word after it */
+			snprintf(pre, sizeof(pre), imm ? "st $" : "st %%%c, ", r1);
+			snprintf(post, sizeof(post), ", %%%c", r2);
+			op_set(op, imm ? 6 : 2, imm ? pre : strcat(pre, post + 2), imm ? post : NULL);
+			break;
+		case INST_LD:
+			snprintf(pre, sizeof(pre), imm ? "ld %%%c, $" : "ld %%%c, %%%c", r1, r2);
+			op_set(op, imm ? 4 : 2, pre, imm ? "" : NULL);
+			break;
+		case INST_CLI:
+		case INST_STI:
+			op_set(op, imm ? 4 : 2, name, NULL);
+			break;
+		case INST_INT:
+			/* Always an immediate; without the M bit ip skips one word less */
+			op_set(op, imm ? 6 : 4, "int $", "");
+			break;
+		default:
+			snprintf(pre, sizeof(pre), "%s %%%c, %%%c", name, r1, r2);
+			op_set(op, imm ? 4 : 2, pre, NULL);
+			break;
+		}
+
+		if (opc >> 12 == INST_CMP)
+			op->ext = cpu_ext_feature[(opc >> 8) & 0xF];
+	}
+
+	for (u32 i = 0; i < 0x100; i++) {
+		const char *name = ext_names[i >> 4];
+
+		if (!name)
+			continue;
+
+		if (i >> 4 == EXT_MOVS || i >> 4 == EXT_FILL)
+			snprintf(pre, sizeof(pre), "%s", name);
+		else
+			snprintf(pre, sizeof(pre), "%s %%%c, %%%c", name, 'a' + ((i >> 2) & 0x3), 'a' + (i & 0x3));
+		op_set(&ext_ops[i], 2, pre, NULL);
+	}
+}
+
+static char *put_hex(char *p, u16 v, char pad)
+{
+	for (int i = 3; i >= 0; i--, v >>= 4)
+		p[i] = v || i == 3 ? hex[v & 0xF] : pad;
+
+	return p + 4;
+}
+
+/* Returns the end of the text, which is not NUL-terminated */
+static inline char *put_insn(char *p, u16 opcode, u16 operand, u16 features, int *len)
+{
+	const struct disasm_op *op = &ops[opcode];
+
+	if (unlikely(op->ext & features))
+		op = &ext_ops[(opcode >> 4) & 0xFF];
+
+	if (op->operand_at == NO_OPERAND) {
+		memcpy(p, op->text, op->text_len);
+		p += op->text_len;
+	} else {
+		memcpy(p, op->text, op->operand_at);
+		p = put_hex(p + op->operand_at, operand, '0');
+		memcpy(p, op->text + op->operand_at, op->text_len - op->operand_at);
+		p += op->text_len - op->operand_at;
+	}
+	*len = op->len;
+
+	return p;
+}
+
+int disasm_insn(u16 opcode, u16 operand, u16 features, char *buf)
+{
+	int len;
+
+	pthread_once(&ops_once, ops_build);
+	*put_insn(buf, opcode, operand, features, &len) = '\0';
+
+	return len;
+}
+
+int disasm(const u8 *memory, u16 addr, u16 features, char *buf)
+{
+	u16 opcode = memory[addr] | (memory[(u16)(addr + 1)] << 8);
+	u16 operand = memory[(u16)(addr + 2)] | (memory[(u16)(addr + 3)] << 8);
+
+	return disasm_insn(opcode, operand, features, buf);
+}
+
+int disasm_line(u16 ip, u16 opcode, u16 operand, u16 features, char *buf)
+{
+	char *p = buf;
+	int len;
+
+	pthread_once(&ops_once, ops_build);
+	p = put_hex(memcpy(p, "ip: ", 4) + 4, ip, ' ');
+	p = put_hex(memcpy(p, " opcode: ", 9) + 9, opcode, ' ');
+	p = put_insn(memcpy(p, ": ", 2) + 2, opcode, operand, features, &len);
+	*p++ = '\n';
+	*p = '\0';
+
+	return p - buf;
+}
+
+void disasm_range(FILE *fp, const u8 *memory, u32 start, u32 end, u16 features)
+{
+	char text[DISASM_MAX];
+
+	for (u32 addr = start; addr < end && addr < MEM_SIZE;) {
+		int len = disasm(memory, addr, features, text);
+
+		fprintf(fp, "%04x: %s\n", addr, text);
+		addr += len;
+	}
+}
+
+struct trace_job {
+	const struct trace_rec *recs;
+	size_t n_recs;
+	size_t n_chunks;
+	u16 features;
+	FILE *fp;
+
+	size_t next; /* chunk to format next */
+	size_t written; /* chunks written so far */
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+};
+
+/* Format chunks as they come, write them in order */
+static void *trace_worker(void *arg)
+{
+	struct trace_job *job = arg;
+	char *buf = malloc((size_t)TRACE_CHUNK * DISASM_LINE_MAX);
+	size_t c;
+
+	while (buf && (c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_chunks) {
+		size_t end = c * TRACE_CHUNK + TRACE_CHUNK < job->n_recs ? c * TRACE_CHUNK + TRACE_CHUNK : job->n_recs;
+		char *p = buf;
+
+		for (size_t i = c * TRACE_CHUNK; i < end; i++) {
+			const struct trace_rec *rec = &job->recs[i];
+
+			p += disasm_line(rec->ip, rec->opcode, rec->operand, job->features, p);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		while (job->written != c)
+			pthread_cond_wait(&job->turn, &job->lock);
+		fwrite(buf, 1, p - buf, job->fp);
+		job->written++;
+		pthread_cond_broadcast(&job->turn);
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(buf);
+
+	return NULL;
+}
+
+int disasm_trace(FILE *fp, const char *path)
+{
+	struct trace_job job = { .fp = fp, .lock = PTHREAD_MUTEX_INITIALIZER, .turn = PTHREAD_COND_INITIALIZER };
+	pthread_t threads[TRACE_THREADS_MAX];
+	const struct trace_hdr *hdr;
+	struct stat st;
+	u8 *file;
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return -1;
+	}
+
+	if (st.st_size < (off_t)sizeof(*hdr) ||
+	    (file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "trace: %s: not a trace\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	hdr = (const struct trace_hdr *)file;
+	if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+		fprintf(stderr, "trace: %s: not a version %d trace\n", path, TRACE_VERSION);
+		munmap(file, st.st_size);
+		return -1;
+	}
+
+	pthread_once(&ops_once, ops_build);
+	madvise(file, st.st_size, MADV_SEQUENTIAL);
+	job.recs = (const struct trace_rec *)(file + sizeof(*hdr));
+	job.n_recs = (st.st_size - sizeof(*hdr)) / sizeof(struct trace_rec);
+	job.n_chunks = (job.n_recs + TRACE_CHUNK - 1) / TRACE_CHUNK;
+	job.features = hdr->features;
+
+	if (n_threads < 1)
+		n_threads = 1;
+	if (n_threads > TRACE_THREADS_MAX)
+		n_threads = TRACE_THREADS_MAX;
+	if ((size_t)n_threads > job.n_chunks)
+		n_threads = job.n_chunks ? job.n_chunks : 1;
+
+	for (long i = 1; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, trace_worker, &job))
+			n_threads = i;
+	}
+	trace_worker(&job);
+	for (long i = 1; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	munmap(file, st.st_size);
+
+	return job.written == job.n_chunks ? 0 : -1;
+}
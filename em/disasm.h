@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Disassembler
+ *
+ * Every one of the 64K opcodes is decoded once, on first use, into a table
+ * entry holding its text in asm_image syntax with a hole for the operand
+ * word, and its length. Formatting an instruction is then a table lookup and
+ * a copy into the caller's buffer.
+ *
+ * The length is how far ip moves when the instruction falls through, which is
+ * what the CPU does, not what asm_image emitted: ST and INT with an immediate
+ * also skip the word after their operand.
+ */
+#ifndef _DISASM_H_
+#define _DISASM_H_
+
+#include <stdio.h>
+#include "opcodes.h"
+
+#define DISASM_MAX 24 /* longest text from disasm_insn(), with the NUL */
+#define DISASM_LINE_MAX 48 /* longest line from disasm_line(), with the NUL */
+
+/*
+ * Format @opcode, with @operand the word after it, into @buf as decoded by a
+ * CPU with @features. Returns the length of the instruction in bytes.
+ */
+int disasm_insn(u16 opcode, u16 operand, u16 features, char *buf);
+/* Same for the instruction at @addr in @memory (MEM_SIZE bytes) */
+int disasm(const u8 *memory, u16 addr, u16 features, char *buf);
+/* "ip: 100 opcode: 7048: ld %b, $0001\n" as in the trace; returns its length */
+int disasm_line(u16 ip, u16 opcode, u16 operand, u16 features, char *buf);
+
+/* Write "addr: text" for every instruction from @start up to @end */
+void disasm_range(FILE *fp, const u8 *memory, u32 start, u32 end, u16 features);
+/* Write the line of every record in the binary trace @path, see trace.h */
+int disasm_trace(FILE *fp, const char *path);
+
+#endif /* _DISASM_H_ */
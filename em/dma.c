@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <string.h>
+#include "bus.h"
+#include "dev.h"
+
+static struct {
+	device_t dev;
+	u16 src;
+	u16 dst;
+	u16 len;
+	u16 ctrl;
+	u16 vec;
+	unsigned int words_per_cycle;
+} dma;
+
+/* The copy is done at once; the controller stays busy for the charged time */
+static void dma_start(cpu_t *cpu)
+{
+	cpu_mem_copy(cpu, dma.dst, dma.src, dma.len);
+
+	dma.ctrl |= DMA_CTRL_BUSY;
+	dev_schedule(&dma.dev, cpu, cpu->cycles + 1 + dma.len / dma.words_per_cycle);
+}
+
+static void dma_event(device_t *dev, cpu_t *cpu)
+{
+	dma.ctrl &= ~DMA_CTRL_BUSY;
+
+	if (dma.ctrl & DMA_CTRL_IRQ)
+		dev_raise_irq(dev, cpu, dma.vec);
+}
+
+static u16 dma_read(device_t *dev, cpu_t *cpu, u16 addr)
+{
+	switch ((addr - DMA_BASE) & ~1) {
+	case DMA_SRC:
+		return dma.src;
+	case DMA_DST:
+		return dma.dst;
+	case DMA_LEN:
+		return dma.len;
+	case DMA_CTRL:
+		return dma.ctrl;
+	case DMA_VEC:
+		return dma.vec;
+	default:
+		return 0;
+	}
+}
+
+static void dma_write(device_t *dev, cpu_t *cpu, u16 addr, u16 value)
+{
+	switch ((addr - DMA_BASE) & ~1) {
+	case DMA_SRC:
+		dma.src = value;
+		break;
+	case DMA_DST:
+		dma.dst = value;
+		break;
+	case DMA_LEN:
+		dma.len = value;
+		break;
+	case DMA_CTRL:
+		dma.ctrl = (dma.ctrl & DMA_CTRL_BUSY) | (value & DMA_CTRL_IRQ);
+		if ((value & DMA_CTRL_START) && !(dma.ctrl & DMA_CTRL_BUSY))
+			dma_start(cpu);
+		break;
+	case DMA_VEC:
+		dma.vec = value;
+		break;
+	default:
+		break;
+	}
+}
+
+static size_t dma_save(device_t *dev, u8 *buf)
+{
+	u16 regs[] = { dma.src, dma.dst, dma.len, dma.ctrl, dma.vec };
+
+	memcpy(buf, regs, sizeof(regs));
+
+	return sizeof(regs);
+}
+
+static size_t dma_restore(device_t *dev, cpu_t *cpu, const u8 *buf)
+{
+	u16 regs[5];
+
+	memcpy(regs, buf, sizeof(regs));
+	dma.src = regs[0];
+	dma.dst = regs[1];
+	dma.len = regs[2];
+	dma.ctrl = regs[3];
+	dma.vec = regs[4];
+
+	return sizeof(regs);
+}
+
+int dma_init(unsigned int words_per_cycle)
+{
+	dma.words_per_cycle = words_per_cycle ? words_per_cycle : 1;
+	dma.dev = (device_t){
+		.name = "dma",
+		.base = DMA_BASE,
+		.size = DMA_VEC + 2,
+		.read = dma_read,
+		.write = dma_write,
+		.event = dma_event,
+		.state_size = 5 * sizeof(u16),
+		.save = dma_save,
+		.restore = dma_restore,
+	};
+
+	return dev_register(&dma.dev);
+}
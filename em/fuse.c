@@ -0,0 +1,449 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <string.h>
+#include "bus.h"
+#include "dev.h"
+#include "fuse.h"
+#include "watch.h"
+
+#define OPC_R1(opc) ((opc >> 6) & 0x3)
+#define OPC_R2(opc) ((opc >> 4) & 0x3)
+#define OPC_EXT(opc) ((opc >> 8) & 0xF)
+
+/* Share of all adjacent pairs a pair needs to be fused: 1/64 */
+#define FUSE_SHARE_SHIFT 6
+
+enum {
+	UOP_SLOW, /* left to cpu_advance() */
+	UOP_CMP,
+	UOP_ADD,
+	UOP_SUB,
+	UOP_OR,
+	UOP_AND,
+	UOP_XOR,
+	UOP_LSH,
+	UOP_RSH,
+	UOP_JNZ,
+	UOP_JNZI,
+	UOP_PUSH,
+	UOP_POP,
+	UOP_MOV,
+	UOP_LDI,
+	UOP_CLI,
+	UOP_STI,
+	UOP_KINDS,
+};
+
+static const char *const uop_names[UOP_KINDS] = {
+	"slow", "cmp", "add", "sub", "or", "and", "xor", "lsh", "rsh",
+	"jnz", "jnzi", "push", "pop", "mov", "ldi", "cli", "sti",
+};
+
+struct uop {
+	u8 kind;
+	u8 r1;
+	u8 r2;
+	u8 len;
+	u16 imm;
+};
+
+struct entry {
+	u8 n; /* 0: not decoded */
+	struct uop u[FUSE_MAX];
+};
+
+u8 fuse_code[MEM_SIZE >> 8];
+
+static struct {
+	struct entry cache[MEM_SIZE];
+	u64 gen; /* bumped when entries are dropped */
+
+	u64 pairs[UOP_KINDS][UOP_KINDS];
+	u8 fused[UOP_KINDS][UOP_KINDS];
+	int n_fused;
+
+	u64 warmup; /* count pairs until this cycle */
+	u16 prev_next; /* ip after the last entry run while warming up */
+	u8 prev_kind;
+
+	u64 dispatches;
+	u64 fast;
+} fuse;
+
+void fuse_flush(u16 page)
+{
+	/* Entries from the page before may run into this one */
+	memset(&fuse.cache[page << 8], 0, 0x100 * sizeof(struct entry));
+	memset(&fuse.cache[((page - 1) & 0xFF) << 8], 0, 0x100 * sizeof(struct entry));
+
+	fuse_code[page] = 0;
+	fuse.gen++;
+}
+
+static void fuse_flush_all(void)
+{
+	memset(fuse.cache, 0, sizeof(fuse.cache));
+	memset(fuse_code, 0, sizeof(fuse_code));
+	fuse.gen++;
+}
+
+/* Whether a kind runs straight on to the next instruction */
+static int uop_straight(int kind)
+{
+	return kind != UOP_SLOW && kind != UOP_JNZ && kind != UOP_JNZI;
+}
+
+static u16 mem_read(const cpu_t *cpu, u16 addr)
+{
+	return cpu->memory[addr] | (cpu->memory[(u16)(addr + 1)] << 8);
+}
+
+/* Decode the instruction at @ip; the same cases as cpu_advance() */
+static struct uop uop_decode(const cpu_t *cpu, u16 ip)
+{
+	static const u8 alu[16] = {
+		[INST_CMP] = UOP_CMP, [INST_ADD] = UOP_ADD, [INST_SUB] = UOP_SUB, [INST_OR] = UOP_OR,
+		[INST_AND] = UOP_AND, [INST_XOR] = UOP_XOR, [INST_LSH] = UOP_LSH, [INST_RSH] = UOP_RSH,
+	};
+	struct uop u = { .kind = UOP_SLOW };
+	u16 opcode, inst, admode;
+
+	/* Fetches from device pages go through the bus */
+	if (dev_map[ip >> 8] || dev_map[(u16)(ip + 3) >> 8])
+		return u;
+
+	opcode = mem_read(cpu, ip);
+	inst = opcode >> 12;
+	admode = (opcode & 0x8) >> 3;
+
+	u.r1 = OPC_R1(opcode);
+	u.r2 = OPC_R2(opcode);
+	u.len = admode ? 4 : 2;
+	u.imm = mem_read(cpu, ip + 2);
+
+	switch (inst) {
+	case INST_CMP:
+		if (OPC_EXT(opcode) && (cpu->features & (CPU_FEAT_ATOMIC | CPU_FEAT_BLOCK)))
+			break;
+		/* fall through */
+	case INST_ADD:
+	case INST_SUB:
+	case INST_OR:
+	case INST_AND:
+	case INST_XOR:
+	case INST_LSH:
+	case INST_RSH:
+		u.kind = alu[inst];
+		break;
+	case INST_JNZ:
+		u.kind = admode ? UOP_JNZI : UOP_JNZ;
+		break;
+	case INST_PUSH:
+		u.kind = UOP_PUSH;
+		break;
+	case INST_POP:
+		u.kind = UOP_POP;
+		break;
+	case INST_ST:
+	case INST_LD:
+		/* ST to an immediate writes its own operand: leave it slow */
+		if (!admode)
+			u.kind = UOP_MOV;
+		else if (inst == INST_LD)
+			u.kind = UOP_LDI;
+		break;
+	case INST_CLI:
+		u.kind = UOP_CLI;
+		break;
+	case INST_STI:
+		u.kind = UOP_STI;
+		break;
+	default:
+		break;
+	}
+
+	return u;
+}
+
+static struct entry *fuse_decode(const cpu_t *cpu, u16 ip)
+{
+	struct entry *e = &fuse.cache[ip];
+	u16 at = ip;
+
+	e->u[0] = uop_decode(cpu, at);
+	e->n = 1;
+
+	while (e->n < FUSE_MAX && uop_straight(e->u[e->n - 1].kind)) {
+		struct uop next;
+
+		at += e->u[e->n - 1].len;
+		next = uop_decode(cpu, at);
+		if (!fuse.fused[e->u[e->n - 1].kind][next.kind])
+			break;
+
+		e->u[e->n++] = next;
+	}
+
+	/* Every byte the entry was decoded from, immediates included */
+	fuse_code[ip >> 8] = 1;
+	fuse_code[(u16)(at + 3) >> 8] = 1;
+
+	return e;
+}
+
+#define ALU(cpu, u, op, flagop, write)                          \
+	do {                                                    \
+		u16 t1 = cpu->r[u->r1];                         \
+		u16 t2 = cpu->r[u->r2];                         \
+		u16 result = t1 op t2;                          \
+		if (flagop != FLAGOP_LOGIC) {                   \
+			cpu->lf_a = t1;                         \
+			cpu->lf_b = t2;                         \
+		}                                               \
+		if (write)                                      \
+			cpu->r[u->r1] = result;                 \
+		SET_RESULT(cpu, flagop, result);                \
+	} while (0)
+
+/* One instruction, with the semantics of its cpu_advance() path */
+static inline void uop_exec(cpu_t *cpu, const struct uop *up)
+{
+	/* A store may drop the entry under us */
+	const struct uop uop = *up, *u = &uop;
+	u16 ip = cpu->ip;
+	busptr_t m;
+
+	cpu->cycles++;
+
+	switch (u->kind) {
+	case UOP_CMP:
+		ALU(cpu, u, -, FLAGOP_SUB, 0);
+		break;
+	case UOP_ADD:
+		ALU(cpu, u, +, FLAGOP_ADD, 1);
+		break;
+	case UOP_SUB:
+		ALU(cpu, u, -, FLAGOP_SUB, 1);
+		break;
+	case UOP_OR:
+		ALU(cpu, u, |, FLAGOP_LOGIC, 1);
+		break;
+	case UOP_AND:
+		ALU(cpu, u, &, FLAGOP_LOGIC, 1);
+		break;
+	case UOP_XOR:
+		ALU(cpu, u, ^, FLAGOP_LOGIC, 1);
+		break;
+	case UOP_LSH:
+		ALU(cpu, u, <<, FLAGOP_LSH, 1);
+		break;
+	case UOP_RSH:
+		ALU(cpu, u, >>, FLAGOP_LOGIC, 1);
+		break;
+	case UOP_JNZ:
+	case UOP_JNZI:
+		/* A jump to itself counts as not taken, as in cpu_advance() */
+		if (cpu->lf_res)
+			cpu->ip = u->kind == UOP_JNZI ? u->imm : cpu->r[u->r1];
+		SET_RESULT(cpu, FLAGOP_LOGIC, 0);
+		break;
+	case UOP_PUSH:
+		cpu->sp -= 2;
+		m = (busptr_t){ .reg_mem_addr = cpu->sp, .type = BUS_MEM };
+		cpu_bus_write(cpu, &m, cpu->r[u->r1]);
+		SET_RESULT(cpu, FLAGOP_LOGIC, cpu->r[u->r1]);
+		break;
+	case UOP_POP:
+		m = (busptr_t){ .reg_mem_addr = cpu->sp, .type = BUS_MEM };
+		cpu->r[u->r1] = cpu_bus_read(cpu, &m);
+		cpu->sp += 2;
+		SET_RESULT(cpu, FLAGOP_LOGIC, cpu->r[u->r1]);
+		break;
+	case UOP_MOV:
+		cpu->r[u->r1] = cpu->r[u->r2];
+		SET_RESULT(cpu, FLAGOP_LOGIC, cpu->r[u->r1]);
+		break;
+	case UOP_LDI:
+		cpu->r[u->r1] = u->imm;
+		SET_RESULT(cpu, FLAGOP_LOGIC, u->imm);
+		break;
+	case UOP_CLI:
+		CLEAR_FLAG(cpu, FLAG_I);
+		SET_RESULT(cpu, FLAGOP_LOGIC, 0);
+		break;
+	case UOP_STI:
+		SET_FLAG(cpu, FLAG_I);
+		__atomic_store_n(&cpu->next_event, 0, __ATOMIC_RELAXED);
+		SET_RESULT(cpu, FLAGOP_LOGIC, 0);
+		break;
+	default:
+		break;
+	}
+
+	if (cpu->ip == ip)
+		cpu->ip += u->len;
+}
+
+/* Pairs that make up at least 1/64 of the adjacent pairs counted */
+static void fuse_plan(void)
+{
+	u64 total = 0;
+
+	for (int a = 0; a < UOP_KINDS; a++) {
+		for (int b = 0; b < UOP_KINDS; b++)
+			total += fuse.pairs[a][b];
+	}
+
+	fuse.n_fused = 0;
+	for (int a = 0; a < UOP_KINDS; a++) {
+		for (int b = 0; b < UOP_KINDS; b++) {
+			fuse.fused[a][b] = uop_straight(a) && b != UOP_SLOW && fuse.pairs[a][b] &&
+					   fuse.pairs[a][b] >= total >> FUSE_SHARE_SHIFT;
+			fuse.n_fused += fuse.fused[a][b];
+		}
+	}
+
+	/* Decoded entries were built without the new pairs */
+	fuse_flush_all();
+}
+
+/* Count the pair of the previous entry's last instruction and this one */
+static void fuse_count(const cpu_t *cpu, const struct entry *e, u16 ip)
+{
+	if (ip == fuse.prev_next)
+		fuse.pairs[fuse.prev_kind][e->u[0].kind]++;
+
+	fuse.prev_kind = e->u[e->n - 1].kind;
+	fuse.prev_next = ip;
+	for (int i = 0; i < e->n; i++)
+		fuse.prev_next += e->u[i].len;
+
+	if (cpu->cycles + 1 >= fuse.warmup) {
+		fuse.warmup = 0;
+		fuse_plan();
+	}
+}
+
+void fuse_advance(cpu_t *cpu, u64 limit)
+{
+	u16 ip = cpu->ip;
+	struct entry *e = &fuse.cache[ip];
+	u64 gen = fuse.gen;
+
+	fuse.dispatches++;
+
+	/* Events, tracing and coverage take the reference path */
+	if (unlikely(cpu->cycles >= __atomic_load_n(&cpu->next_event, __ATOMIC_RELAXED) || cpu->trace ||
+		     cpu->cov_map)) {
+		cpu_advance(cpu);
+		return;
+	}
+
+	if (unlikely(!e->n))
+		e = fuse_decode(cpu, ip);
+
+	if (unlikely(fuse.warmup))
+		fuse_count(cpu, e, ip);
+
+	if (unlikely(e->u[0].kind == UOP_SLOW)) {
+		cpu_advance(cpu);
+		return;
+	}
+
+	fuse.fast += e->n;
+	for (int i = 0;;) {
+		uop_exec(cpu, &e->u[i]);
+
+		/* Stop early for a due event, a watchpoint hit, or when the code was written */
+		if (++i == e->n)
+			break;
+		if (unlikely(cpu->cycles == limit)) {
+			fuse.fast -= e->n - i;
+			break;
+		}
+		if (unlikely(cpu->cycles >= __atomic_load_n(&cpu->next_event, __ATOMIC_RELAXED) || gen != fuse.gen ||
+			     watch_break)) {
+			fuse.fast -= e->n - i;
+			break;
+		}
+	}
+}
+
+int fuse_init(u64 warmup, const char *profile)
+{
+	FILE *fp;
+	char a[16], b[16];
+	unsigned long long count;
+
+	fuse_flush_all();
+	fuse.warmup = warmup;
+	fuse.prev_next = 0xFFFF;
+
+	if (!profile)
+		return 0;
+
+	fp = fopen(profile, "r");
+	if (!fp) {
+		perror(profile);
+		return -1;
+	}
+
+	/* "first second count" per line */
+	while (fscanf(fp, "%15s %15s %llu", a, b, &count) == 3) {
+		int ka = -1, kb = -1;
+
+		for (int k = 0; k < UOP_KINDS; k++) {
+			if (!strcmp(a, uop_names[k]))
+				ka = k;
+			if (!strcmp(b, uop_names[k]))
+				kb = k;
+		}
+
+		if (ka < 0 || kb < 0) {
+			fprintf(stderr, "%s: unknown pair %s %s\n", profile, a, b);
+			fclose(fp);
+			return -1;
+		}
+		fuse.pairs[ka][kb] += count;
+	}
+	fclose(fp);
+
+	if (!warmup)
+		fuse_plan();
+
+	return 0;
+}
+
+int fuse_save(const char *profile)
+{
+	FILE *fp = fopen(profile, "w");
+
+	if (!fp) {
+		perror(profile);
+		return -1;
+	}
+
+	for (int a = 0; a < UOP_KINDS; a++) {
+		for (int b = 0; b < UOP_KINDS; b++) {
+			if (fuse.pairs[a][b])
+				fprintf(fp, "%s %s %llu\n", uop_names[a], uop_names[b], fuse.pairs[a][b]);
+		}
+	}
+
+	return fclose(fp);
+}
+
+void fuse_report(const cpu_t *cpu, FILE *fp)
+{
+	fprintf(fp, "fuse: %llu instructions in %llu dispatches (%.1f%% fewer), %llu predecoded, %d pairs fused:",
+		cpu->cycles, fuse.dispatches, cpu->cycles ? 100.0 - 100.0 * fuse.dispatches / cpu->cycles : 0.0,
+		fuse.fast, fuse.n_fused);
+
+	for (int a = 0; a < UOP_KINDS; a++) {
+		for (int b = 0; b < UOP_KINDS; b++) {
+			if (fuse.fused[a][b])
+				fprintf(fp, " %s+%s", uop_names[a], uop_names[b]);
+		}
+	}
+	fputc('\n', fp);
+}
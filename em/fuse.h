@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Predecoded engine with superinstructions
+ *
+ * Instructions are decoded once into a per-address cache and run from there,
+ * with cpu_advance() as the fallback for anything unusual (device pages, INT,
+ * ST to an immediate, extensions, tracing). Adjacent instructions whose kinds
+ * form a hot pair are fused into one entry of up to FUSE_MAX instructions that
+ * runs with a single dispatch. Which pairs are hot comes from counting the
+ * pairs executed during a warm-up, or from a saved profile.
+ *
+ * Stores to a page holding decoded code drop the entries that cover it, so
+ * self-modifying code and hot patches are seen on the next dispatch.
+ */
+#ifndef _FUSE_H_
+#define _FUSE_H_
+
+#include <stdio.h>
+#include "opcodes.h"
+
+#define FUSE_MAX 3
+
+/* Pages holding decoded instructions */
+extern u8 fuse_code[MEM_SIZE >> 8];
+
+void fuse_flush(u16 page);
+
+/* Guest memory in [addr, addr + len) is about to change or has changed */
+static inline void fuse_touch(u16 addr, u32 len)
+{
+	u32 first = addr >> 8;
+	u32 last = (addr + len - 1) >> 8;
+
+	if (unlikely(!len))
+		return;
+
+	for (u32 page = first; page <= last; page++) {
+		if (unlikely(fuse_code[page & 0xFF]))
+			fuse_flush(page & 0xFF);
+	}
+}
+
+/* Count pairs for @warmup instructions, then fuse; @profile may be NULL */
+int fuse_init(u64 warmup, const char *profile);
+/* Run the instruction, or fused instructions, at ip; not past cycle @limit */
+void fuse_advance(cpu_t *cpu, u64 limit);
+int fuse_save(const char *profile);
+void fuse_report(const cpu_t *cpu, FILE *fp);
+
+#endif /* _FUSE_H_ */
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include "bus.h"
+#include "dev.h"
+#include "fuzz.h"
+#include "snapshot.h"
+
+/* AFL fork-server protocol */
+#define FORKSRV_FD 198
+#define FS_OPT_ENABLED 0x80000001
+#define FS_OPT_SHDMEM_FUZZ 0x01000000
+#define SHM_FUZZ_MAX 0x100000
+#define PERSIST_MAX 10000
+
+/* Tells afl-fuzz to use persistent mode */
+static const char persist_sig[] __attribute__((used)) = "##SIG_AFL_PERSISTENT##";
+
+static snapshot_t snap;
+/* Device registers, events and bank store at the snapshot, NULL without devices */
+static u8 *dev_state;
+static u8 local_map[COV_MAP_SIZE];
+
+/* AFL++ shared-memory testcase: length followed by data */
+static struct {
+	unsigned int len;
+	u8 data[];
+} *shm_input;
+
+static u8 input_buf[SHM_FUZZ_MAX];
+
+static void *shm_attach(const char *env)
+{
+	const char *id = getenv(env);
+	if (!id)
+		return NULL;
+
+	void *p = shmat(atoi(id), NULL, 0);
+
+	return p == (void *)-1 ? NULL : p;
+}
+
+static int fuzz_prepare(cpu_t *cpu, const struct fuzz_config *cfg)
+{
+	u8 *map = shm_attach("__AFL_SHM_ID");
+
+	cpu->cov_map = map ? map : local_map;
+	cpu->trace = 0;
+
+	/* Run the guest's own initialization once, outside the measured loop */
+	if (cfg->init_addr) {
+		for (u64 i = 0; cpu->ip != cfg->init_addr; i++) {
+			if (i == cfg->max_cycles) {
+				fprintf(stderr, "fuzz: init address $%x not reached\n", cfg->init_addr);
+				return -1;
+			}
+			cpu_advance(cpu);
+		}
+	}
+
+	if (dev_state_size()) {
+		dev_state = malloc(dev_state_size());
+		if (!dev_state) {
+			perror("fuzz");
+			return -1;
+		}
+		dev_save(dev_state);
+	}
+	snapshot_take(cpu, &snap);
+
+	return 0;
+}
+
+int fuzz_run_one(cpu_t *cpu, const struct fuzz_config *cfg, const u8 *data, size_t len)
+{
+	/* Devices first: the mapper must show the right banks before RAM goes back */
+	if (dev_state)
+		dev_restore(cpu, dev_state);
+	snapshot_restore(cpu, &snap);
+	if (dev_state)
+		dev_touch(0, MEM_SIZE);
+
+	if (len > cfg->input_max)
+		len = cfg->input_max;
+
+	cpu_mem_patch(cpu, cfg->input_addr, data, len);
+	cpu->a = len;
+
+	for (u64 end = cpu->cycles + cfg->max_cycles; cpu->cycles < end;) {
+		cpu_advance(cpu);
+
+		if (cpu->ip == cfg->exit_addr)
+			return FUZZ_OK;
+		if (cpu->ip == cfg->crash_addr)
+			return FUZZ_CRASH;
+	}
+
+	return FUZZ_TIMEOUT;
+}
+
+static size_t read_input(const char *path)
+{
+	if (shm_input) {
+		size_t len = shm_input->len;
+		if (len > SHM_FUZZ_MAX - sizeof(*shm_input))
+			len = SHM_FUZZ_MAX - sizeof(*shm_input);
+		memcpy(input_buf, shm_input->data, len);
+		return len;
+	}
+
+	FILE *fp = path ? fopen(path, "rb") : stdin;
+	if (!fp)
+		return 0;
+
+	if (!path)
+		fseek(fp, 0, SEEK_SET);
+
+	size_t len = fread(input_buf, 1, sizeof(input_buf), fp);
+	if (path)
+		fclose(fp);
+
+	return len;
+}
+
+/* Child side of the fork server: run inputs until told to stop */
+static void persistent_loop(cpu_t *cpu, const struct fuzz_config *cfg, const char *path)
+{
+	for (int i = 0; i < PERSIST_MAX; i++) {
+		size_t len = read_input(path);
+
+		if (fuzz_run_one(cpu, cfg, input_buf, len) == FUZZ_CRASH)
+			abort();
+
+		raise(SIGSTOP);
+	}
+
+	_exit(0);
+}
+
+static int fork_server(cpu_t *cpu, const struct fuzz_config *cfg, const char *path)
+{
+	unsigned int status = 0;
+	unsigned int was_killed;
+	int child_stopped = 0;
+	pid_t child = -1;
+
+	shm_input = shm_attach("__AFL_SHM_FUZZ_ID");
+	if (shm_input)
+		status = FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ;
+
+	/* Not running under afl-fuzz */
+	if (write(FORKSRV_FD + 1, &status, 4) != 4)
+		return -1;
+
+	if (shm_input) {
+		if (read(FORKSRV_FD, &was_killed, 4) != 4 || was_killed != status)
+			shm_input = NULL;
+	}
+
+	for (;;) {
+		if (read(FORKSRV_FD, &was_killed, 4) != 4)
+			_exit(0);
+
+		if (child_stopped && was_killed) {
+			child_stopped = 0;
+			waitpid(child, (int *)&status, 0);
+		}
+
+		if (!child_stopped) {
+			child = fork();
+			if (child < 0)
+				_exit(1);
+
+			if (!child) {
+				close(FORKSRV_FD);
+				close(FORKSRV_FD + 1);
+				persistent_loop(cpu, cfg, path);
+			}
+		} else {
+			kill(child, SIGCONT);
+			child_stopped = 0;
+		}
+
+		write(FORKSRV_FD + 1, &child, 4);
+
+		if (waitpid(child, (int *)&status, WUNTRACED) < 0)
+			_exit(1);
+		if (WIFSTOPPED(status))
+			child_stopped = 1;
+
+		write(FORKSRV_FD + 1, &status, 4);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int fuzz_main(cpu_t *cpu, const struct fuzz_config *cfg, char **files, int n_files)
+{
+	static const char *results[] = { "ok", "crash", "timeout" };
+
+	if (fuzz_prepare(cpu, cfg))
+		return 1;
+
+	fork_server(cpu, cfg, n_files ? files[0] : NULL);
+
+	/* Standalone: run each file once and report its coverage */
+	double start = now();
+	int ret = 0;
+
+	for (int i = 0; i < (n_files ? n_files : 1); i++) {
+		const char *path = n_files ? files[i] : NULL;
+		size_t len = read_input(path);
+		int edges = 0;
+
+		memset(cpu->cov_map, 0, COV_MAP_SIZE);
+		int res = fuzz_run_one(cpu, cfg, input_buf, len);
+
+		for (int j = 0; j < COV_MAP_SIZE; j++)
+			edges += !!cpu->cov_map[j];
+
+		printf("%s: %s, %d edges, %llu cycles\n", path ? path : "<stdin>", results[res], edges,
+		       cpu->cycles - snap.cpu.cycles);
+		if (res == FUZZ_CRASH)
+			ret = 1;
+	}
+
+	double elapsed = now() - start;
+	if (elapsed > 0)
+		fprintf(stderr, "%.0f execs/s\n", (n_files ? n_files : 1) / elapsed);
+
+	return ret;
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Coverage-guided fuzzing harness
+ *
+ * The guest is run up to an init point and snapshotted, devices included, so
+ * nothing one input does carries over to the next. Every input is then
+ * copied into guest memory, the length is put in register A and the guest is
+ * run from the snapshot until it reaches the exit address, jumps to the crash
+ * address or runs out of cycles. Taken JNZ/INT edges are recorded in an
+ * AFL-compatible bitmap.
+ */
+#ifndef _FUZZ_H_
+#define _FUZZ_H_
+
+#include <stddef.h>
+#include "opcodes.h"
+
+#define FUZZ_OK 0
+#define FUZZ_CRASH 1
+#define FUZZ_TIMEOUT 2
+
+struct fuzz_config {
+	u16 init_addr; /* snapshot once ip gets here; 0 snapshots at reset */
+	u16 exit_addr; /* input done */
+	u16 crash_addr; /* guest-detected failure */
+	u16 input_addr; /* where the input is copied */
+	u16 input_max; /* longer inputs are truncated */
+	u64 max_cycles; /* per input */
+};
+
+int fuzz_run_one(cpu_t *cpu, const struct fuzz_config *cfg, const u8 *data, size_t len);
+int fuzz_main(cpu_t *cpu, const struct fuzz_config *cfg, char **files, int n_files);
+
+#endif /* _FUZZ_H_ */
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bus.h"
+#include "hotpatch.h"
+#include "replay.h"
+
+struct patch {
+	struct patch *next;
+	u16 addr;
+	u16 len;
+	u8 data[];
+};
+
+atomic_int hotpatch_pending;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct patch *head, **tail = &head;
+
+static void *hotpatch_thread(void *arg)
+{
+	int fd = (int)(long)arg;
+	static u8 buf[sizeof(struct hotpatch_hdr) + HOTPATCH_MAX];
+
+	for (;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		struct hotpatch_hdr hdr;
+
+		if (n < (ssize_t)sizeof(hdr))
+			continue;
+
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.magic != HOTPATCH_MAGIC || hdr.len != n - sizeof(hdr))
+			continue;
+
+		struct patch *p = malloc(sizeof(*p) + hdr.len);
+		if (!p)
+			continue;
+
+		p->next = NULL;
+		p->addr = hdr.addr;
+		p->len = hdr.len;
+		memcpy(p->data, buf + sizeof(hdr), hdr.len);
+
+		pthread_mutex_lock(&lock);
+		*tail = p;
+		tail = &p->next;
+		pthread_mutex_unlock(&lock);
+
+		atomic_store_explicit(&hotpatch_pending, 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+int hotpatch_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "hotpatch: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("hotpatch: socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("hotpatch: bind");
+		close(fd);
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, hotpatch_thread, (void *)(long)fd)) {
+		close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+void hotpatch_apply(cpu_t *cpu)
+{
+	struct patch *p;
+
+	pthread_mutex_lock(&lock);
+	atomic_store_explicit(&hotpatch_pending, 0, memory_order_relaxed);
+	p = head;
+	head = NULL;
+	tail = &head;
+	pthread_mutex_unlock(&lock);
+
+	while (p) {
+		struct patch *next = p->next;
+
+		if (replay_mode == REPLAY_RECORD)
+			replay_patch(cpu, p->addr, p->data, p->len);
+		cpu_mem_patch(cpu, p->addr, p->data, p->len);
+		free(p);
+		p = next;
+	}
+}
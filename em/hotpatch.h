@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Hot reload of guest memory
+ *
+ * The assembler's watch mode sends one datagram per changed memory range to
+ * a UNIX socket owned by the emulator. A listener thread queues the patches
+ * and the run loop applies them between instructions.
+ */
+#ifndef _HOTPATCH_H_
+#define _HOTPATCH_H_
+
+#include <stdint.h>
+
+#define HOTPATCH_MAGIC 0x5043534d /* "MSCP" */
+#define HOTPATCH_MAX 0x8000 /* max bytes per datagram */
+
+struct hotpatch_hdr {
+	uint32_t magic;
+	uint16_t addr;
+	uint16_t len;
+	/* followed by @len bytes */
+};
+
+#ifndef __cplusplus
+#include <stdatomic.h>
+#include "opcodes.h"
+
+extern atomic_int hotpatch_pending;
+
+int hotpatch_listen(const char *path);
+void hotpatch_apply(cpu_t *cpu);
+#endif
+
+#endif /* _HOTPATCH_H_ */
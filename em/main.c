@@ -5,20 +5,470 @@
 * This is for testing purposes only
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include "bus.h"
+#include "hotpatch.h"
+#include "fuzz.h"
+#include "watch.h"
+#include "perf.h"
+#include "smp.h"
+#include "dev.h"
+#include "replay.h"
+#include "fuse.h"
+#include "mem.h"
+#include "warm.h"
+#include "video.h"
+#include "disasm.h"
+#include "trace.h"
+#include "verify.h"
 
-int main()
+#define MAX_WATCH_ARGS 16
+
+struct watch_arg {
+	const char *spec;
+	int mode;
+};
+
+static int add_watch(const struct watch_arg *w)
+{
+	char *end;
+	unsigned long addr = strtoul(w->spec, &end, 0);
+	unsigned long len = *end == ',' ? strtoul(end + 1, NULL, 0) : 2;
+
+	if (watch_add(addr, len, w->mode)) {
+		fprintf(stderr, "Invalid watchpoint: %s\n", w->spec);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Comma-separated extension names, see CPU_FEAT_* */
+static int parse_features(char *list, u16 *features)
+{
+	for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		if (!strcmp(name, "atomic"))
+			*features |= CPU_FEAT_ATOMIC;
+		else if (!strcmp(name, "block"))
+			*features |= CPU_FEAT_BLOCK;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+static void sigint_handler(int sig)
+{
+	perf_stop();
+	smp_stop();
+	replay_stop();
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] [-i image] [-d delay_us] [-N insns] [-S socket] [-w|-b addr,len]...\n", prog);
+	fprintf(stderr, "       %s -O warmup|-L profile [-W profile] [-j interval] [options] [-i image] [-d delay_us] [-N insns]\n", prog);
+	fprintf(stderr, "       %s -Z image [-T addr] [options] [-i image] [-d delay_us] [-N insns] [-S socket]\n", prog);
+	fprintf(stderr, "       %s -z image [options] [-d delay_us] [-N insns] [-S socket]\n", prog);
+	fprintf(stderr, "       %s -c cores [-Q quantum] [-D] [options] [-i image] [-N insns] [-S socket]\n", prog);
+	fprintf(stderr, "       %s -p period [-P map] [options] [-i image] [-N insns]\n", prog);
+	fprintf(stderr, "       %s -R log [-I interval] [options] [-i image] [-d delay_us] [-N insns] [-S socket]\n", prog);
+	fprintf(stderr, "       %s -Y log [-G cycle] [-N cycle] [options]\n", prog);
+	fprintf(stderr, "       %s -U start,end [-x atomic,block] [-i image|-z image]\n", prog);
+	fprintf(stderr, "       %s -y trace\n", prog);
+	fprintf(stderr, "       %s -F [-E init] [-X exit] [-C crash] [-A addr] [-M max] [-n cycles] [input...]\n", prog);
+	fprintf(stderr, "Options: -q -t trace -m anon|heap|huge|cow|shm:name -x atomic,block -V|-v instance [-K words_per_cycle] -u stdio|pty|path -B size|path\n");
+}
+
+int main(int argc, char *argv[])
 {
-	cpu_t cpu;
-	cpu_init(&cpu);
+	const char *image = "../asm/out.bin";
+	const char *hot_sock = NULL;
+	useconds_t delay = 10000;
+	int quiet = 0;
+	int fuzz = 0;
+	struct watch_arg watch_args[MAX_WATCH_ARGS];
+	int n_watch_args = 0;
+	unsigned long long limit = 0;
+	unsigned int perf_period = 0;
+	const char *perf_map = NULL;
+	u16 features = 0;
+	int video = 0;
+	char video_name[32] = VIDEO_SHM_NAME;
+	unsigned int dma_rate = 8;
+	const char *uart = NULL;
+	const char *banks = NULL;
+	const char *record = NULL;
+	const char *replay = NULL;
+	unsigned long long seek = 0;
+	unsigned long long interval = 100000000;
+	int fuse = 0;
+	unsigned long long warmup = 0;
+	const char *profile_in = NULL;
+	const char *profile_out = NULL;
+	const char *mem_spec = "anon";
+	const char *warm_out = NULL;
+	const char *warm_in = NULL;
+	long warm_at = -1;
+	const char *trace_out = NULL;
+	const char *listing = NULL;
+	int verify = 0;
+	unsigned long long verify_interval = 0;
+	char text[DISASM_MAX];
+	struct smp_config scfg = {
+		.n_cores = 1,
+		.quantum = 1000,
+		.deterministic = 0,
+	};
+	struct fuzz_config fcfg = {
+		.init_addr = 0,
+		.exit_addr = 0xFFFE,
+		.crash_addr = 0xFFFF,
+		.input_addr = 0x8000,
+		.input_max = 0x1000,
+		.max_cycles = 100000,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:d:S:qFE:X:C:A:M:n:w:b:N:p:P:c:Q:Dx:VK:u:B:R:Y:G:I:O:L:W:m:Z:z:T:v:t:y:U:j:")) != -1) {
+		switch (opt) {
+		case 'i':
+			image = optarg;
+			break;
+		case 'd':
+			delay = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			hot_sock = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'F':
+			fuzz = 1;
+			break;
+		case 'E':
+			fcfg.init_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'X':
+			fcfg.exit_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			fcfg.crash_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			fcfg.input_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			fcfg.input_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			fcfg.max_cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'N':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			perf_period = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			perf_map = optarg;
+			break;
+		case 'c':
+			scfg.n_cores = strtoul(optarg, NULL, 0);
+			break;
+		case 'Q':
+			scfg.quantum = strtoull(optarg, NULL, 0);
+			break;
+		case 'D':
+			scfg.deterministic = 1;
+			break;
+		case 'x':
+			if (parse_features(optarg, &features)) {
+				fprintf(stderr, "Unknown extension in %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'V':
+			video = 1;
+			break;
+		case 'v':
+			video = 1;
+			snprintf(video_name, sizeof(video_name), VIDEO_SHM_INSTANCE, (unsigned int)strtoul(optarg, NULL, 0));
+			break;
+		case 'K':
+			dma_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			uart = optarg;
+			break;
+		case 'B':
+			banks = optarg;
+			break;
+		case 'R':
+			record = optarg;
+			break;
+		case 'Y':
+			replay = optarg;
+			break;
+		case 'G':
+			seek = strtoull(optarg, NULL, 0);
+			break;
+		case 'I':
+			interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			fuse = 1;
+			warmup = strtoull(optarg, NULL, 0);
+			break;
+		case 'L':
+			fuse = 1;
+			profile_in = optarg;
+			break;
+		case 'W':
+			profile_out = optarg;
+			break;
+		case 'm':
+			mem_spec = optarg;
+			break;
+		case 'Z':
+			warm_out = optarg;
+			break;
+		case 'z':
+			warm_in = optarg;
+			break;
+		case 'T':
+			warm_at = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace_out = optarg;
+			break;
+		case 'y':
+			return disasm_trace(stdout, optarg) ? 1 : 0;
+		case 'U':
+			listing = optarg;
+			break;
+		case 'j':
+			verify = 1;
+			verify_interval = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+		case 'b':
+			if (n_watch_args == MAX_WATCH_ARGS) {
+				fprintf(stderr, "Too many watchpoints\n");
+				return 1;
+			}
+			watch_args[n_watch_args++] = (struct watch_arg){ optarg, opt == 'b' ? WATCH_BREAK : WATCH_LOG };
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	const char *mem_arg;
+	const mem_alloc_t *alloc = mem_find(mem_spec, &mem_arg);
+	if (!alloc) {
+		fprintf(stderr, "Unknown memory allocator %s\n", mem_spec);
+		return 1;
+	}
+	if (!(alloc->flags & MEM_SMALL_PAGES) && (n_watch_args || banks || video)) {
+		fprintf(stderr, "Watchpoints, banks and video need anon, cow or shm memory\n");
+		return 1;
+	}
+	/* cow maps the image itself */
+	if ((alloc->flags & MEM_PRELOADED) && !mem_arg)
+		mem_arg = image;
+
+	static cpu_t cpu;
+	if (cpu_init_mem(&cpu, alloc, mem_arg)) {
+		perror("cpu_init");
+		return 1;
+	}
+	cpu.trace = !quiet;
+	cpu.features = features;
+
+	if ((record || replay) && (fuzz || perf_period || scfg.n_cores > 1 || scfg.deterministic)) {
+		fprintf(stderr, "Record and replay need a plain single-core run\n");
+		return 1;
+	}
+
+	/* Device state is not locked; only one host thread may run guest code */
+	if (scfg.n_cores > 1 && !scfg.deterministic && (video || uart || banks)) {
+		fprintf(stderr, "Devices need a single core or -D\n");
+		return 1;
+	}
+
+	if (warm_out && (fuzz || perf_period || scfg.n_cores > 1 || scfg.deterministic || replay)) {
+		fprintf(stderr, "Warm images are saved from a plain single-core run\n");
+		return 1;
+	}
+
+	/* A replay or warm start takes the memory and banks from its snapshot */
+	FILE *fp = replay || warm_in ? NULL : fopen(image, "rb");
+	if (!fp && !replay && !warm_in) {
+		perror(image);
+		return 1;
+	}
+	if (fp && (alloc->flags & MEM_PRELOADED))
+		fseek(fp, MEM_SIZE, SEEK_SET);
+	else if (fp)
+		fread(cpu.memory, 1, MEM_SIZE, fp);
+
+	/* Anything past the first 64 KB of the image goes to the banks */
+	if (banks && (mapper_init(&cpu, banks) || (fp && mapper_load(fp))))
+		return 1;
+	if (fp)
+		fclose(fp);
+
+	if (video && (video_init(&cpu, video_name) || dma_init(dma_rate)))
+		return 1;
+
+	if (uart && uart_init(uart))
+		return 1;
 
-	FILE *fp = fopen("../asm/out.bin", "rb");
-	fread(&cpu.memory, 1, 0x10000, fp);
-	fclose(fp);
+	if ((warm_out || warm_in) && warm_init())
+		return 1;
 
-	while (1) {
-		cpu_advance(&cpu);
-		usleep(10000);
+	if (warm_in && warm_load(&cpu, warm_in))
+		return 1;
+
+	if (listing) {
+		char *end;
+		unsigned long start = strtoul(listing, &end, 0);
+
+		disasm_range(stdout, cpu.memory, start, *end == ',' ? strtoul(end + 1, NULL, 0) : MEM_SIZE, features);
+		return 0;
+	}
+
+	/* Cores after the first get the atomics, see smp_run() */
+	if (trace_out && trace_open(trace_out, features | (scfg.n_cores > 1 ? CPU_FEAT_ATOMIC : 0)))
+		return 1;
+	if (trace_out)
+		cpu.trace = 1;
+
+	if (n_watch_args && watch_init(&cpu))
+		return 1;
+
+	for (int i = 0; i < n_watch_args; i++) {
+		if (add_watch(&watch_args[i]))
+			return 1;
 	}
+
+	if (fuzz)
+		return fuzz_main(&cpu, &fcfg, argv + optind, argc - optind);
+
+	if (perf_period) {
+		if (perf_init(perf_period, perf_map))
+			return 1;
+
+		signal(SIGINT, sigint_handler);
+		perf_run(&cpu, limit);
+		perf_report(stderr);
+
+		return 0;
+	}
+
+	if (replay) {
+		if (replay_open(&cpu, replay, seek))
+			return 1;
+
+		/* Silent up to the cycle asked for, then traced as usual */
+		signal(SIGINT, sigint_handler);
+		while (replay_running(&cpu) && (!limit || cpu.cycles < limit)) {
+			cpu.trace = (trace_out || !quiet) && cpu.cycles >= seek;
+			cpu_advance(&cpu);
+		}
+
+		disasm(cpu.memory, cpu.ip, cpu.features, text);
+		fprintf(stderr, "Replay stopped at cycle %llu ip $%04x (%s): a=%04x b=%04x c=%04x d=%04x sp=%04x flags=%04x\n",
+			cpu.cycles, cpu.ip, text, cpu.a, cpu.b, cpu.c, cpu.d, cpu.sp, cpu_flags(&cpu));
+		replay_close(&cpu);
+
+		return 0;
+	}
+
+	if (hot_sock && hotpatch_listen(hot_sock))
+		return 1;
+
+	if (scfg.n_cores > 1 || scfg.deterministic) {
+		if (n_watch_args) {
+			fprintf(stderr, "Watchpoints need a single core\n");
+			return 1;
+		}
+
+		scfg.limit = limit;
+		signal(SIGINT, sigint_handler);
+		if (smp_run(&cpu, &scfg))
+			return 1;
+		smp_report(stderr);
+
+		return 0;
+	}
+
+	if (record) {
+		if (replay_record(&cpu, record, interval))
+			return 1;
+		signal(SIGINT, sigint_handler);
+	}
+
+	if (fuse && fuse_init(warmup, profile_in))
+		return 1;
+
+	if (verify) {
+		char names[64];
+
+		if (!fuse || dev_names(names, sizeof(names)) || n_watch_args || hot_sock || record || warm_out) {
+			fprintf(stderr, "Verification needs -O or -L and a run without devices, watchpoints or patches\n");
+			return 1;
+		}
+
+		signal(SIGINT, sigint_handler);
+		if (verify_run(&cpu, limit, verify_interval, stderr))
+			return 1;
+		if (profile_out && fuse_save(profile_out))
+			return 1;
+
+		return 0;
+	}
+
+	while ((!limit || cpu.cycles < limit) && !replay_done) {
+		if (atomic_load_explicit(&hotpatch_pending, memory_order_acquire))
+			hotpatch_apply(&cpu);
+
+		/* A fused entry may run past -T, so step singly until the image is saved */
+		if (fuse && !(warm_out && warm_at >= 0))
+			fuse_advance(&cpu, limit);
+		else
+			cpu_advance(&cpu);
+		if (delay)
+			usleep(delay);
+
+		if (unlikely(warm_out) && (warm_request || cpu.ip == warm_at)) {
+			if (warm_save(&cpu, warm_out))
+				return 1;
+			warm_out = NULL;
+		}
+
+		if (watch_break) {
+			disasm(cpu.memory, cpu.ip, cpu.features, text);
+			fprintf(stderr, "Stopped at ip $%04x (%s): a=%04x b=%04x c=%04x d=%04x sp=%04x flags=%04x\n", cpu.ip,
+				text, cpu.a, cpu.b, cpu.c, cpu.d, cpu.sp, cpu_flags(&cpu));
+			replay_close(&cpu);
+			return 2;
+		}
+	}
+
+	replay_close(&cpu);
+	if (fuse) {
+		fuse_report(&cpu, stderr);
+		if (profile_out && fuse_save(profile_out))
+			return 1;
+	}
+
+	return 0;
 }
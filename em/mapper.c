@@ -0,0 +1,303 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Bank-switched memory
+ *
+ * The banks live in a host file or memfd, and selecting one maps it over its
+ * window of guest memory with mmap(MAP_FIXED). Only the host page tables
+ * change: nothing is copied, and bus accesses stay plain memory accesses.
+ * Each window's own RAM is kept in a separate memfd so it can be mapped back.
+ *
+ * A bank can only be written while it is mapped, so saved states carry just
+ * the banks ever loaded or mapped, and a restore copies back just those
+ * mapped since the store last matched the state.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include "dev.h"
+#include "fuse.h"
+#include "watch.h"
+
+static struct {
+	device_t dev;
+	cpu_t *cpu;
+	int store_fd;
+	int home_fd;
+	u8 *store;
+	size_t store_size;
+	u16 n_banks;
+	u16 bank[BANK_WINDOWS];
+
+	/* Per bank: may hold data, so states carry it */
+	u8 *used;
+	/* Per bank and window's own RAM: may differ from the state numbered serial */
+	u8 *changed;
+	u8 home_changed[BANK_WINDOWS];
+	u64 serial;
+	u64 next_serial;
+} mapper;
+
+/* Followed by the windows' own RAM, n_saved bank numbers and those banks */
+struct mapper_state {
+	u64 serial;
+	u16 bank[BANK_WINDOWS];
+	u16 n_saved;
+};
+
+static int mapper_map(int window, u16 bank)
+{
+	u8 *addr = mapper.cpu->memory + BANK_WINDOW(window);
+	int fd = bank == MAPPER_HOME ? mapper.home_fd : mapper.store_fd;
+	off_t off = (off_t)(bank == MAPPER_HOME ? window : bank) * BANK_SIZE;
+
+	if (bank != MAPPER_HOME && bank >= mapper.n_banks)
+		return -1;
+
+	if (mmap(addr, BANK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, off) == MAP_FAILED)
+		return -1;
+
+	mapper.bank[window] = bank;
+	if (bank == MAPPER_HOME)
+		mapper.home_changed[window] = 1;
+	else
+		mapper.used[bank] = mapper.changed[bank] = 1;
+	fuse_touch(BANK_WINDOW(window), BANK_SIZE);
+	/* The new pages came without the watchpoint protection */
+	watch_rearm();
+
+	return 0;
+}
+
+static u16 mapper_read(device_t *dev, cpu_t *cpu, u16 addr)
+{
+	switch ((addr - MAPPER_BASE) & ~1) {
+	case MAPPER_BANK0:
+		return mapper.bank[0];
+	case MAPPER_BANK1:
+		return mapper.bank[1];
+	case MAPPER_NBANKS:
+		return mapper.n_banks;
+	default:
+		return 0;
+	}
+}
+
+static void mapper_write(device_t *dev, cpu_t *cpu, u16 addr, u16 value)
+{
+	int window = ((addr - MAPPER_BASE) & ~1) / 2;
+
+	/* Out-of-range banks leave the window as it was */
+	if (window < BANK_WINDOWS && value != mapper.bank[window])
+		mapper_map(window, value);
+}
+
+/* The store matches state @serial now, apart from what is mapped */
+static void mapper_sync(u64 serial)
+{
+	mapper.serial = serial;
+	memset(mapper.changed, 0, mapper.n_banks);
+	for (int w = 0; w < BANK_WINDOWS; w++) {
+		mapper.home_changed[w] = mapper.bank[w] == MAPPER_HOME;
+		if (mapper.bank[w] != MAPPER_HOME)
+			mapper.changed[mapper.bank[w]] = 1;
+	}
+}
+
+/* Only banks that were ever loaded or mapped: the rest are still zero */
+static size_t mapper_save(device_t *dev, u8 *buf)
+{
+	struct mapper_state st = { .serial = mapper.next_serial };
+	u8 *p = buf + sizeof(st);
+
+	mapper.next_serial += 2;
+	memcpy(st.bank, mapper.bank, sizeof(st.bank));
+	if (pread(mapper.home_fd, p, BANK_WINDOWS * BANK_SIZE, 0) != BANK_WINDOWS * BANK_SIZE)
+		memset(p, 0, BANK_WINDOWS * BANK_SIZE);
+	p += BANK_WINDOWS * BANK_SIZE;
+
+	for (u16 b = 0; b < mapper.n_banks; b++) {
+		if (!mapper.used[b])
+			continue;
+		memcpy(p, &b, sizeof(b));
+		p += sizeof(b);
+		st.n_saved++;
+	}
+	for (u16 b = 0; b < mapper.n_banks; b++) {
+		if (!mapper.used[b])
+			continue;
+		memcpy(p, mapper.store + (size_t)b * BANK_SIZE, BANK_SIZE);
+		p += BANK_SIZE;
+	}
+	memcpy(buf, &st, sizeof(st));
+	mapper_sync(st.serial);
+
+	return p - buf;
+}
+
+/*
+ * Restoring the state the store last matched, as the fuzzer does for every
+ * input, only copies back the banks mapped since then
+ */
+static size_t mapper_restore(device_t *dev, cpu_t *cpu, const u8 *buf)
+{
+	struct mapper_state st;
+	const u8 *home = buf + sizeof(st);
+	const u8 *list = home + BANK_WINDOWS * BANK_SIZE;
+	const u8 *data;
+	int same;
+	u16 i = 0;
+
+	memcpy(&st, buf, sizeof(st));
+	data = list + st.n_saved * sizeof(u16);
+	same = st.serial == mapper.serial;
+
+	for (int w = 0; w < BANK_WINDOWS; w++) {
+		if ((!same || mapper.home_changed[w]) &&
+		    pwrite(mapper.home_fd, home + w * BANK_SIZE, BANK_SIZE, w * BANK_SIZE) != BANK_SIZE)
+			perror("mapper: restore");
+	}
+
+	/* The list is in bank order */
+	for (u16 b = 0; b < mapper.n_banks; b++) {
+		u8 *bank = mapper.store + (size_t)b * BANK_SIZE;
+		u16 next = MAPPER_HOME;
+
+		if (i < st.n_saved)
+			memcpy(&next, list + i * sizeof(u16), sizeof(next));
+
+		if (next == b) {
+			if (!same || mapper.changed[b])
+				memcpy(bank, data + (size_t)i * BANK_SIZE, BANK_SIZE);
+			mapper.used[b] = 1;
+			i++;
+		} else if (mapper.used[b]) {
+			memset(bank, 0, BANK_SIZE);
+			mapper.used[b] = 0;
+		}
+	}
+
+	for (int w = 0; w < BANK_WINDOWS; w++)
+		mapper_map(w, st.bank[w]);
+	mapper_sync(st.serial);
+
+	return data + (size_t)st.n_saved * BANK_SIZE - buf;
+}
+
+static int mapper_open(const char *spec)
+{
+	char *end;
+	unsigned long long size = strtoull(spec, &end, 0);
+
+	if (end != spec) {
+		/* A size, with an optional K or M suffix */
+		if (*end == 'K' || *end == 'k')
+			size <<= 10;
+		else if (*end == 'M' || *end == 'm')
+			size <<= 20;
+
+		mapper.store_fd = memfd_create("msc16-banks", MFD_CLOEXEC);
+		if (mapper.store_fd < 0 || ftruncate(mapper.store_fd, size)) {
+			perror("mapper: memfd");
+			return -1;
+		}
+	} else {
+		struct stat st;
+
+		mapper.store_fd = open(spec, O_RDWR | O_CLOEXEC);
+		if (mapper.store_fd < 0 || fstat(mapper.store_fd, &st)) {
+			perror(spec);
+			return -1;
+		}
+		size = st.st_size;
+	}
+
+	size /= BANK_SIZE;
+	if (!size || size >= MAPPER_HOME) {
+		fprintf(stderr, "mapper: %s: need 1 to %d banks of %d bytes\n", spec, MAPPER_HOME - 1, BANK_SIZE);
+		return -1;
+	}
+
+	mapper.n_banks = size;
+	mapper.store_size = size * BANK_SIZE;
+	mapper.used = calloc(size, 1);
+	mapper.changed = calloc(size, 1);
+	if (!mapper.used || !mapper.changed) {
+		perror("mapper");
+		return -1;
+	}
+	/* A file may hold data in any bank */
+	if (end == spec)
+		memset(mapper.used, 1, size);
+	mapper.store = mmap(NULL, mapper.store_size, PROT_READ | PROT_WRITE, MAP_SHARED, mapper.store_fd, 0);
+	if (mapper.store == MAP_FAILED) {
+		perror("mapper: mmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+int mapper_init(cpu_t *cpu, const char *spec)
+{
+	if (BANK_SIZE % sysconf(_SC_PAGESIZE)) {
+		fprintf(stderr, "mapper: unsupported host page size\n");
+		return -1;
+	}
+
+	if (mapper_open(spec))
+		return -1;
+
+	/* Odd, and unlikely to be another run's: 0 is no state at all */
+	if (getrandom(&mapper.next_serial, sizeof(mapper.next_serial), 0) != sizeof(mapper.next_serial))
+		mapper.next_serial = getpid();
+	mapper.next_serial |= 1;
+
+	/* Move the windows' RAM into the home memfd and map it back in place */
+	mapper.cpu = cpu;
+	mapper.home_fd = memfd_create("msc16-home", MFD_CLOEXEC);
+	if (mapper.home_fd < 0 || ftruncate(mapper.home_fd, BANK_WINDOWS * BANK_SIZE)) {
+		perror("mapper: memfd");
+		return -1;
+	}
+
+	for (int w = 0; w < BANK_WINDOWS; w++) {
+		if (pwrite(mapper.home_fd, cpu->memory + BANK_WINDOW(w), BANK_SIZE, w * BANK_SIZE) != BANK_SIZE ||
+		    mapper_map(w, MAPPER_HOME)) {
+			perror("mapper: window");
+			return -1;
+		}
+	}
+
+	mapper.dev = (device_t){
+		.name = "mapper",
+		.base = MAPPER_BASE,
+		.size = MAPPER_NBANKS + 2,
+		.read = mapper_read,
+		.write = mapper_write,
+		.state_size = sizeof(struct mapper_state) + BANK_WINDOWS * BANK_SIZE +
+			      mapper.n_banks * (sizeof(u16) + BANK_SIZE),
+		.save = mapper_save,
+		.restore = mapper_restore,
+	};
+
+	return dev_register(&mapper.dev);
+}
+
+int mapper_load(FILE *fp)
+{
+	size_t n = fread(mapper.store, 1, mapper.store_size, fp);
+
+	memset(mapper.used, 1, (n + BANK_SIZE - 1) / BANK_SIZE);
+
+	if (n == mapper.store_size && fgetc(fp) != EOF) {
+		fprintf(stderr, "mapper: image has more banks than the store (%u)\n", mapper.n_banks);
+		return -1;
+	}
+
+	return 0;
+}
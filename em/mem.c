@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mem.h"
+
+#define HUGE_SIZE (2 << 20)
+#define HUGE_SLICES (HUGE_SIZE / MEM_SIZE)
+
+static u8 *anon_alloc(const char *arg)
+{
+	u8 *memory = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return memory == MAP_FAILED ? NULL : memory;
+}
+
+static void unmap_free(u8 *memory)
+{
+	munmap(memory, MEM_SIZE);
+}
+
+const mem_alloc_t mem_anon = {
+	.name = "anon",
+	.flags = MEM_SMALL_PAGES,
+	.alloc = anon_alloc,
+	.free = unmap_free,
+};
+
+static u8 *heap_alloc(const char *arg)
+{
+	void *memory;
+
+	if (posix_memalign(&memory, 4096, MEM_SIZE))
+		return NULL;
+
+	return memset(memory, 0, MEM_SIZE);
+}
+
+static void heap_free(u8 *memory)
+{
+	free(memory);
+}
+
+static const mem_alloc_t mem_heap = {
+	.name = "heap",
+	.alloc = heap_alloc,
+	.free = heap_free,
+};
+
+/* 2 MB huge pages carved into MEM_SIZE slices; a page is never returned */
+static struct huge_page {
+	u8 *base;
+	u32 used; /* bitmap of slices */
+	struct huge_page *next;
+} *huge_pages;
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(HUGE_SLICES <= 32, "one bit per slice");
+
+static struct huge_page *huge_page_new(void)
+{
+	struct huge_page *hp = calloc(1, sizeof(*hp));
+	u8 *base;
+
+	if (!hp)
+		return NULL;
+
+	base = mmap(NULL, HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED) {
+		/* No hugetlbfs pages reserved: ask for a transparent one */
+		if (posix_memalign((void **)&base, HUGE_SIZE, HUGE_SIZE)) {
+			free(hp);
+			return NULL;
+		}
+		madvise(base, HUGE_SIZE, MADV_HUGEPAGE);
+		memset(base, 0, HUGE_SIZE);
+	}
+
+	hp->base = base;
+	hp->next = huge_pages;
+	huge_pages = hp;
+
+	return hp;
+}
+
+static u8 *huge_alloc(const char *arg)
+{
+	struct huge_page *hp;
+	u8 *memory = NULL;
+
+	pthread_mutex_lock(&huge_lock);
+	for (hp = huge_pages; hp && hp->used == (u32)((1ULL << HUGE_SLICES) - 1); hp = hp->next)
+		;
+	if (!hp)
+		hp = huge_page_new();
+
+	if (hp) {
+		int slice = __builtin_ctz(~hp->used);
+
+		hp->used |= 1u << slice;
+		memory = hp->base + slice * MEM_SIZE;
+		memset(memory, 0, MEM_SIZE);
+	}
+	pthread_mutex_unlock(&huge_lock);
+
+	return memory;
+}
+
+static void huge_free(u8 *memory)
+{
+	pthread_mutex_lock(&huge_lock);
+	for (struct huge_page *hp = huge_pages; hp; hp = hp->next) {
+		if (memory >= hp->base && memory < hp->base + HUGE_SIZE)
+			hp->used &= ~(1u << ((memory - hp->base) / MEM_SIZE));
+	}
+	pthread_mutex_unlock(&huge_lock);
+}
+
+static const mem_alloc_t mem_huge = {
+	.name = "huge",
+	.alloc = huge_alloc,
+	.free = huge_free,
+};
+
+/* Map @arg, the image, privately: instances share its pages until written */
+static u8 *cow_alloc(const char *arg)
+{
+	struct stat st;
+	int fd = arg ? open(arg, O_RDONLY | O_CLOEXEC) : -1;
+	u8 *memory = NULL;
+
+	if (fd < 0)
+		return NULL;
+
+	/* Zero pages past the end of a short image */
+	if (!fstat(fd, &st) && (memory = anon_alloc(NULL))) {
+		size_t len = st.st_size < MEM_SIZE ? st.st_size : MEM_SIZE;
+
+		if (len && mmap(memory, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			unmap_free(memory);
+			memory = NULL;
+		}
+	}
+	close(fd);
+
+	return memory;
+}
+
+static const mem_alloc_t mem_cow = {
+	.name = "cow",
+	.flags = MEM_SMALL_PAGES | MEM_PRELOADED,
+	.alloc = cow_alloc,
+	.free = unmap_free,
+};
+
+/* Open or create the shared memory object @arg, e.g. "/msc16-mem" */
+static u8 *shm_alloc(const char *arg)
+{
+	int fd = arg ? shm_open(arg, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+	u8 *memory = MAP_FAILED;
+
+	if (fd < 0)
+		return NULL;
+
+	if (!ftruncate(fd, MEM_SIZE))
+		memory = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return memory == MAP_FAILED ? NULL : memory;
+}
+
+static const mem_alloc_t mem_shm = {
+	.name = "shm",
+	.flags = MEM_SMALL_PAGES,
+	.alloc = shm_alloc,
+	.free = unmap_free,
+};
+
+static const mem_alloc_t *const allocators[] = { &mem_anon, &mem_heap, &mem_huge, &mem_cow, &mem_shm };
+
+const mem_alloc_t *mem_find(const char *spec, const char **arg)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+	*arg = colon ? colon + 1 : NULL;
+	for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		if (strlen(allocators[i]->name) == len && !strncmp(spec, allocators[i]->name, len))
+			return allocators[i];
+	}
+
+	return NULL;
+}
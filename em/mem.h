@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Guest memory allocators
+ *
+ * A cpu_t only points at its MEM_SIZE bytes of guest memory, so where they
+ * come from is up to the allocator it was created with:
+ *
+ *   anon   private anonymous mapping (the default)
+ *   heap   page-aligned malloc
+ *   huge   64 KB slices of 2 MB huge pages, shared by many instances
+ *   cow    the first MEM_SIZE bytes of a file, mapped copy-on-write
+ *   shm    a POSIX shared memory object, for other processes to map
+ *
+ * Watchpoints, the bank mapper and the framebuffer change the protection and
+ * mapping of single 4 KB pages, which only allocators with MEM_SMALL_PAGES
+ * allow.
+ */
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include "opcodes.h"
+
+#define MEM_SMALL_PAGES 0x1 /* backed by mmap()ed 4 KB pages */
+#define MEM_PRELOADED 0x2 /* comes with the image already in it */
+
+typedef struct mem_alloc {
+	const char *name;
+	int flags;
+	/* @arg is the text after "name:" in the spec, or NULL */
+	u8 *(*alloc)(const char *arg);
+	void (*free)(u8 *memory);
+} mem_alloc_t;
+
+extern const mem_alloc_t mem_anon;
+
+/* Allocator for "name" or "name:arg", with the arg in *@arg */
+const mem_alloc_t *mem_find(const char *spec, const char **arg);
+
+#endif /* _MEM_H_ */
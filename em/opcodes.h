@@ -4,8 +4,12 @@
 
 typedef unsigned char u8;
 typedef unsigned short u16;
+typedef unsigned int u32;
 typedef unsigned long long u64;
 
+#define likely(x) (__builtin_expect(!!(x), 1))
+#define unlikely(x) (__builtin_expect(!!(x), 0))
+
 #define INST_CMP 0x0
 #define INST_ADD 0x1
 #define INST_SUB 0x2
@@ -23,20 +27,47 @@ typedef unsigned long long u64;
 #define INST_STI 0xE
 #define INST_INT 0xF
 
+/* Extended instructions: CMP with a nonzero RRRR field, gated by features */
+#define EXT_XCHG 0x1
+#define EXT_CAS 0x2
+#define EXT_MUL 0x3
+#define EXT_MOVS 0x4
+#define EXT_FILL 0x5
+
+/* cpu_t.features */
+#define CPU_FEAT_ATOMIC 0x1 /* XCHG, CAS */
+#define CPU_FEAT_BLOCK 0x2 /* MUL, MOVS, FILL */
+
+#define MEM_SIZE 0x10000
+#define COV_MAP_SIZE 0x10000
+
 #define FLAG_Z 0x1
 #define FLAG_N 0x2
 #define FLAG_V 0x4
 #define FLAG_I 0x8
 
-#define INVALIDATE_FLAGS(cpu) (cpu->flags = 0)
+/* Flags derived from the last result, see cpu_flags() */
+#define FLAGS_LAZY (FLAG_Z | FLAG_N | FLAG_V)
+
+/* How FLAG_V is derived from the last result */
+#define FLAGOP_LOGIC 0 /* V is always clear */
+#define FLAGOP_ADD 1
+#define FLAGOP_SUB 2
+#define FLAGOP_LSH 3
+#define FLAGOP_MUL 4
+
+#define SET_RESULT(cpu, op, res) ((cpu)->lf_op = (op), (cpu)->lf_res = (res))
 #define SET_FLAG(cpu, flag) (cpu->flags |= flag)
 #define CLEAR_FLAG(cpu, flag) (cpu->flags &= ~flag)
-#define TEST_FLAG(cpu, flag) (cpu->flags & flag)
+#define TEST_FLAG(cpu, flag) (cpu_flags(cpu) & (flag))
 
 #define CPU_REG_READ(cpu, reg) (cpu->r[reg])
 #define CPU_REG_WRITE(cpu, reg, value) (CPU_REG_READ(cpu, reg) = value)
 #define IP_ADVANCE(cpu, n) (cpu->ip += n)
 
+struct mem_alloc;
+
+/* Everything an instruction touches is in the first cache line */
 typedef struct cpu {
 	union {
 		struct {
@@ -51,10 +82,68 @@ typedef struct cpu {
 
 	u16 sp;
 	u16 ip;
-	u16 flags;
+	u16 flags; /* FLAG_I only; Z/N/V are evaluated lazily */
+
+	/* Last result, and the operands and operation it came from */
+	u16 lf_res;
+	u16 lf_a;
+	u16 lf_b;
+	u8 lf_op;
+
+	u8 trace; /* print every instruction */
+	u16 features; /* CPU_FEAT_*; extensions that are off decode as CMP */
+	u64 cycles; /* instructions executed */
+	u64 next_event; /* cycles at which dev_service() is due; 0: now */
+
+	/* MEM_SIZE bytes, page aligned; see cpu_init() */
+	u8 *memory;
+
+	/* Edge coverage bitmap (COV_MAP_SIZE bytes), or NULL */
+	u8 *cov_map;
+	u16 cov_prev;
+
+	/* Owner of memory, or NULL when it belongs to another core */
+	const struct mem_alloc *alloc;
+} __attribute__((aligned(64))) cpu_t;
+
+_Static_assert(__builtin_offsetof(cpu_t, cov_prev) < 64, "hot state in one cache line");
+
+/* Materialize the architectural FLAGS register */
+static inline u16 cpu_flags(const cpu_t *cpu)
+{
+	u16 res = cpu->lf_res;
+	u16 a = cpu->lf_a;
+	u16 b = cpu->lf_b;
+	u16 flags = cpu->flags & ~FLAGS_LAZY;
+
+	if (res == 0)
+		flags |= FLAG_Z;
+	if (res & 0x8000)
+		flags |= FLAG_N;
+
+	switch (cpu->lf_op) {
+	case FLAGOP_ADD:
+		if ((a ^ res) & (b ^ res) & 0x8000)
+			flags |= FLAG_V;
+		break;
+	case FLAGOP_SUB:
+		if ((a ^ b) & (a ^ res) & 0x8000)
+			flags |= FLAG_V;
+		break;
+	case FLAGOP_LSH:
+		/* Signed overflow: shifting back does not give the operand */
+		if (b >= 16 ? a != 0 : (short)((short)res >> b) != (short)a)
+			flags |= FLAG_V;
+		break;
+	case FLAGOP_MUL:
+		if ((short)a * (short)b != (short)res)
+			flags |= FLAG_V;
+		break;
+	default:
+		break;
+	}
 
-    // 65536
-	u8 memory[0x10000];
-} cpu_t;
+	return flags;
+}
 
 #endif /* _OPCODES_H_ */
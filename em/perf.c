@@ -0,0 +1,317 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bus.h"
+#include "perf.h"
+
+#define PAGE_REGIONS 256
+#define MAX_LABEL 64
+
+enum { PC_CYCLES, PC_INSNS, PC_BRANCH_MISS, PC_L1I_MISS, PC_L1D_MISS, N_PC };
+
+#define CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	unsigned int type;
+	u64 config;
+	const char *name;
+} counters[N_PC] = {
+	[PC_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	[PC_INSNS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "insns" },
+	[PC_BRANCH_MISS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "br-miss" },
+	[PC_L1I_MISS] = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1I), "l1i-miss" },
+	[PC_L1D_MISS] = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), "l1d-miss" },
+};
+
+struct region {
+	char name[MAX_LABEL];
+	u16 start;
+	u64 guest_insns;
+	u64 blocks;
+	u64 host[N_PC];
+};
+
+static int fds[N_PC] = { -1, -1, -1, -1, -1 };
+static int leader = -1; /* the first counter that opened; reads the group */
+static struct perf_event_mmap_page *pages[N_PC];
+static int use_rdpmc;
+
+static struct region *regions;
+static size_t n_regions;
+static int by_label;
+static unsigned int sample_period;
+static volatile sig_atomic_t stopped;
+
+static long perf_event_open(struct perf_event_attr *attr, int group)
+{
+	return syscall(SYS_perf_event_open, attr, 0, -1, group, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline u64 rdpmc(unsigned int counter)
+{
+	unsigned int lo, hi;
+
+	__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+
+	return lo | (u64)hi << 32;
+}
+
+/* User-space counter read, see perf_event_mmap_page in linux/perf_event.h */
+static int read_mmap(struct perf_event_mmap_page *pc, u64 *value)
+{
+	unsigned int seq;
+	u64 count;
+
+	do {
+		seq = pc->lock;
+		__sync_synchronize();
+
+		if (!pc->cap_user_rdpmc || !pc->index)
+			return -1;
+
+		u64 pmc = rdpmc(pc->index - 1);
+		pmc <<= 64 - pc->pmc_width;
+		pmc >>= 64 - pc->pmc_width;
+		count = pc->offset + pmc;
+
+		__sync_synchronize();
+	} while (pc->lock != seq);
+
+	*value = count;
+
+	return 0;
+}
+#else
+static int read_mmap(struct perf_event_mmap_page *pc, u64 *value)
+{
+	return -1;
+}
+#endif
+
+static void read_counters(u64 *values)
+{
+	if (use_rdpmc) {
+		for (int i = 0; i < N_PC; i++) {
+			if (fds[i] < 0 || read_mmap(pages[i], &values[i]))
+				values[i] = 0;
+		}
+		return;
+	}
+
+	/* One syscall for the whole group */
+	u64 buf[1 + N_PC];
+	memset(values, 0, N_PC * sizeof(*values));
+	if (leader < 0 || read(leader, buf, sizeof(buf)) < (ssize_t)sizeof(u64))
+		return;
+
+	for (int i = 0, j = 1; i < N_PC && j <= (int)buf[0]; i++) {
+		if (fds[i] >= 0)
+			values[i] = buf[j++];
+	}
+}
+
+static int open_counters(void)
+{
+	for (int i = 0; i < N_PC; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counters[i].type;
+		attr.config = counters[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = leader < 0;
+
+		fds[i] = perf_event_open(&attr, leader);
+		if (fds[i] < 0)
+			continue;
+
+		if (leader < 0)
+			leader = fds[i];
+
+		pages[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fds[i], 0);
+		if (pages[i] == MAP_FAILED)
+			pages[i] = NULL;
+	}
+
+	if (leader < 0)
+		return -1;
+
+	ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	/* Prefer rdpmc when every counter allows it */
+	u64 v;
+	use_rdpmc = 1;
+	for (int i = 0; i < N_PC; i++) {
+		if (fds[i] >= 0 && (!pages[i] || read_mmap(pages[i], &v)))
+			use_rdpmc = 0;
+	}
+
+	return 0;
+}
+
+static int load_map(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	unsigned int addr;
+	char name[MAX_LABEL];
+
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	/* Region 0 covers anything before the first label */
+	regions = calloc(1, sizeof(*regions));
+	strcpy(regions[0].name, "<start>");
+	n_regions = 1;
+
+	while (fscanf(fp, "%x %63s", &addr, name) == 2) {
+		regions = realloc(regions, (n_regions + 1) * sizeof(*regions));
+		memset(&regions[n_regions], 0, sizeof(*regions));
+		regions[n_regions].start = addr;
+		strcpy(regions[n_regions].name, name);
+		n_regions++;
+	}
+
+	fclose(fp);
+	by_label = 1;
+
+	return 0;
+}
+
+static size_t region_of(u16 ip)
+{
+	if (!by_label)
+		return ip >> 8;
+
+	/* Last label at or below ip; the map is sorted by address */
+	size_t lo = 1, hi = n_regions;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (regions[mid].start <= ip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+int perf_init(unsigned int period, const char *map)
+{
+	sample_period = period ? period : 1;
+
+	if (map) {
+		if (load_map(map))
+			return -1;
+	} else {
+		n_regions = PAGE_REGIONS;
+		regions = calloc(n_regions, sizeof(*regions));
+		for (size_t i = 0; i < n_regions; i++) {
+			regions[i].start = i << 8;
+			snprintf(regions[i].name, MAX_LABEL, "$%04zx", i << 8);
+		}
+	}
+
+	if (open_counters())
+		fprintf(stderr, "perf: hardware counters unavailable, guest profile only\n");
+
+	return 0;
+}
+
+void perf_stop(void)
+{
+	stopped = 1;
+}
+
+void perf_run(cpu_t *cpu, u64 n)
+{
+	u64 last[N_PC], now[N_PC];
+	u64 start = cpu->cycles;
+	u64 mark = cpu->cycles;
+	size_t region = region_of(cpu->ip);
+	unsigned int blocks = 0;
+
+	read_counters(last);
+
+	while (!stopped && (!n || cpu->cycles - start < n)) {
+		u16 ip = cpu->ip;
+
+		cpu_advance(cpu);
+
+		/* Sequential execution stays within the block */
+		if ((u16)(cpu->ip - ip) <= 4)
+			continue;
+
+		/* Guest counts are exact; only the host counter reads are sampled */
+		regions[region].blocks++;
+		regions[region].guest_insns += cpu->cycles - mark;
+		mark = cpu->cycles;
+
+		if (++blocks >= sample_period) {
+			blocks = 0;
+			read_counters(now);
+			for (int i = 0; i < N_PC; i++)
+				regions[region].host[i] += now[i] - last[i];
+			memcpy(last, now, sizeof(last));
+		}
+
+		region = region_of(cpu->ip);
+	}
+
+	read_counters(now);
+	for (int i = 0; i < N_PC; i++)
+		regions[region].host[i] += now[i] - last[i];
+	regions[region].guest_insns += cpu->cycles - mark;
+}
+
+static int cmp_region(const void *a, const void *b)
+{
+	const struct region *ra = a, *rb = b;
+
+	if (ra->host[PC_CYCLES] != rb->host[PC_CYCLES])
+		return ra->host[PC_CYCLES] < rb->host[PC_CYCLES] ? 1 : -1;
+
+	return ra->guest_insns < rb->guest_insns ? 1 : ra->guest_insns > rb->guest_insns ? -1 : 0;
+}
+
+void perf_report(FILE *fp)
+{
+	qsort(regions, n_regions, sizeof(*regions), cmp_region);
+
+	fprintf(fp, "%-20s %12s %10s", "region", "guest-insns", "blocks");
+	for (int i = 0; i < N_PC; i++)
+		fprintf(fp, " %12s", counters[i].name);
+	fprintf(fp, " %8s\n", "cyc/insn");
+
+	for (size_t r = 0; r < n_regions; r++) {
+		const struct region *reg = &regions[r];
+
+		if (!reg->guest_insns)
+			continue;
+
+		fprintf(fp, "%-20s %12llu %10llu", reg->name, reg->guest_insns, reg->blocks);
+		for (int i = 0; i < N_PC; i++) {
+			if (fds[i] >= 0)
+				fprintf(fp, " %12llu", reg->host[i]);
+			else
+				fprintf(fp, " %12s", "-");
+		}
+		if (fds[PC_CYCLES] >= 0)
+			fprintf(fp, " %8.1f\n", (double)reg->host[PC_CYCLES] / reg->guest_insns);
+		else
+			fprintf(fp, " %8s\n", "-");
+	}
+}
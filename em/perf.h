@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Host hardware-counter profile per guest code region
+ *
+ * Host cycles, instructions, branch misses and L1 misses are sampled at guest
+ * block boundaries (taken branches) and the deltas are charged to the region
+ * the block ran in: the enclosing label from an asm_image symbol map, or the
+ * 256-byte page of the guest ip. Guest instruction and block counts are kept
+ * alongside, so the report shows which guest code stresses which host paths.
+ * Those are counted at every block; with a period above 1 each host delta
+ * goes to the region of the block that closes the sample.
+ */
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdio.h>
+#include "opcodes.h"
+
+/* Sample every @period blocks; @map may be NULL */
+int perf_init(unsigned int period, const char *map);
+/* Run @cpu for up to @n instructions (0: until perf_stop()) while profiling */
+void perf_run(cpu_t *cpu, u64 n);
+void perf_stop(void);
+void perf_report(FILE *fp);
+
+#endif /* _PERF_H_ */
@@ -0,0 +1,424 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bus.h"
+#include "dev.h"
+#include "fuse.h"
+#include "replay.h"
+#include "snapshot.h"
+
+#define LOG_READ 0 /* addr, value */
+#define LOG_IRQ 1 /* vector */
+#define LOG_EVENT 2 /* device index */
+#define LOG_PATCH 3 /* addr, len, bytes */
+#define LOG_CHECKPOINT 4 /* checkpoint number */
+#define LOG_END 5
+
+#define LOG_BUF_SIZE (1 << 20)
+#define NAMES_MAX 256
+
+struct ckpt_hdr {
+	u32 magic;
+	u32 version;
+	u64 state_max; /* dev_state_size() of the machine */
+};
+
+/* Followed by state_size bytes of device state and a snapshot_t */
+struct ckpt_rec {
+	u64 cycle;
+	u64 offset; /* of the log entry after the checkpoint */
+	u64 state_size;
+};
+
+struct entry {
+	u64 cycle;
+	int kind;
+	u16 addr;
+	u16 value;
+	u16 len;
+};
+
+int replay_mode;
+volatile sig_atomic_t replay_done;
+
+static struct {
+	FILE *log;
+	FILE *ckpt;
+	u64 last; /* cycle of the previous entry */
+	u64 interval;
+	u64 next_ckpt;
+	u64 n_ckpts;
+	size_t state_size;
+	u8 *state;
+	snapshot_t snap;
+
+	struct entry next; /* replay: the entry to be consumed next */
+	u8 patch[MEM_SIZE];
+} rr;
+
+static void put_varint(u64 v)
+{
+	while (v >= 0x80) {
+		putc_unlocked((v & 0x7F) | 0x80, rr.log);
+		v >>= 7;
+	}
+	putc_unlocked(v, rr.log);
+}
+
+static int get_varint(u64 *v)
+{
+	u64 x = 0;
+	int c;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		c = getc_unlocked(rr.log);
+		if (c == EOF)
+			return -1;
+
+		x |= (u64)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			*v = x;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void put_entry(cpu_t *cpu, int kind)
+{
+	put_varint((cpu->cycles - rr.last) << 3 | kind);
+	rr.last = cpu->cycles;
+}
+
+static void checkpoint(cpu_t *cpu)
+{
+	struct ckpt_rec rec = { .cycle = cpu->cycles };
+
+	put_entry(cpu, LOG_CHECKPOINT);
+	put_varint(rr.n_ckpts++);
+	rec.offset = ftell(rr.log);
+
+	rec.state_size = dev_save(rr.state);
+	snapshot_take(cpu, &rr.snap);
+	fwrite(&rec, sizeof(rec), 1, rr.ckpt);
+	fwrite(rr.state, 1, rec.state_size, rr.ckpt);
+	fwrite(&rr.snap, sizeof(rr.snap), 1, rr.ckpt);
+
+	/* A crash loses at most one interval */
+	fflush(rr.log);
+	fflush(rr.ckpt);
+
+	rr.next_ckpt = cpu->cycles + rr.interval;
+}
+
+static char *ckpt_path(const char *path)
+{
+	char *p = malloc(strlen(path) + sizeof(".ckpt"));
+
+	if (p)
+		strcat(strcpy(p, path), ".ckpt");
+
+	return p;
+}
+
+int replay_record(cpu_t *cpu, const char *path, u64 interval)
+{
+	struct ckpt_hdr hdr = { REPLAY_MAGIC, REPLAY_VERSION, 0 };
+	u32 magic[2] = { REPLAY_MAGIC, REPLAY_VERSION };
+	char names[NAMES_MAX];
+	size_t len = dev_names(names, sizeof(names));
+	char *cpath = ckpt_path(path);
+
+	rr.log = fopen(path, "wb");
+	rr.ckpt = cpath ? fopen(cpath, "wb") : NULL;
+	if (!rr.log || !rr.ckpt) {
+		perror(rr.log ? cpath : path);
+		free(cpath);
+		return -1;
+	}
+	free(cpath);
+	setvbuf(rr.log, NULL, _IOFBF, LOG_BUF_SIZE);
+
+	rr.state_size = dev_state_size();
+	rr.state = malloc(rr.state_size + 1);
+	if (!rr.state)
+		return -1;
+
+	/* Replay needs the same devices: their registers are not all logged */
+	fwrite(magic, sizeof(magic), 1, rr.log);
+	put_varint(len);
+	fwrite(names, 1, len, rr.log);
+
+	hdr.state_max = rr.state_size;
+	fwrite(&hdr, sizeof(hdr), 1, rr.ckpt);
+
+	rr.interval = interval ? interval : 1;
+	rr.last = cpu->cycles;
+	replay_mode = REPLAY_RECORD;
+	checkpoint(cpu);
+	cpu->next_event = 0;
+
+	return 0;
+}
+
+/* Log the point of divergence once and stop the replay */
+static void diverged(cpu_t *cpu, const char *what)
+{
+	static const char *kinds[] = { "read", "interrupt", "event", "patch", "checkpoint", "end" };
+
+	if (replay_done)
+		return;
+
+	fprintf(stderr, "replay: diverged at cycle %llu ip $%04x: %s, log has %s at cycle %llu\n", cpu->cycles, cpu->ip,
+		what, kinds[rr.next.kind], rr.next.cycle);
+	replay_done = 1;
+}
+
+/* Read the entry after the current one; a truncated log ends at its last entry */
+static void next_entry(cpu_t *cpu)
+{
+	struct entry *e = &rr.next;
+	u64 head, a = 0, b = 0;
+
+	if (get_varint(&head) || (head & 7) > LOG_END)
+		goto end;
+
+	e->cycle = rr.last + (head >> 3);
+	e->kind = head & 7;
+	rr.last = e->cycle;
+
+	switch (e->kind) {
+	case LOG_READ:
+	case LOG_PATCH:
+		if (get_varint(&a) || get_varint(&b))
+			goto end;
+		break;
+	case LOG_IRQ:
+	case LOG_EVENT:
+	case LOG_CHECKPOINT:
+		if (get_varint(&b))
+			goto end;
+		break;
+	default:
+		break;
+	}
+
+	e->addr = a;
+	e->value = b;
+	e->len = b;
+	if (e->kind == LOG_PATCH && fread(rr.patch, 1, e->len, rr.log) != e->len)
+		goto end;
+
+	/* Anything but a read is fed in by replay_service() */
+	if (e->kind != LOG_READ)
+		cpu->next_event = 0;
+	return;
+
+end:
+	*e = (struct entry){ .cycle = rr.last, .kind = LOG_END };
+	cpu->next_event = 0;
+}
+
+/*
+ * Records differ in size with the banks in use, so walk them to the last one
+ * at or before @seek; there is one per interval, few enough to step through
+ */
+static int find_ckpt(u64 seek, long size, struct ckpt_rec *rec)
+{
+	struct ckpt_rec cur;
+	long pos = sizeof(struct ckpt_hdr), found = -1;
+
+	/* A record cut short by a crash ends the walk */
+	while (fseek(rr.ckpt, pos, SEEK_SET) == 0 && fread(&cur, sizeof(cur), 1, rr.ckpt) == 1 &&
+	       cur.state_size <= rr.state_size &&
+	       pos + sizeof(cur) + cur.state_size + sizeof(snapshot_t) <= (u64)size && (found < 0 || cur.cycle <= seek)) {
+		*rec = cur;
+		found = pos;
+		pos += sizeof(cur) + cur.state_size + sizeof(snapshot_t);
+	}
+
+	if (found < 0)
+		return -1;
+
+	return fseek(rr.ckpt, found + sizeof(*rec), SEEK_SET);
+}
+
+int replay_open(cpu_t *cpu, const char *path, u64 seek)
+{
+	struct ckpt_hdr hdr;
+	struct ckpt_rec rec;
+	u32 magic[2];
+	char names[NAMES_MAX], have[NAMES_MAX];
+	u64 len;
+	long size;
+	char *cpath = ckpt_path(path);
+
+	rr.log = fopen(path, "rb");
+	rr.ckpt = cpath ? fopen(cpath, "rb") : NULL;
+	if (!rr.log || !rr.ckpt) {
+		perror(rr.log ? cpath : path);
+		free(cpath);
+		return -1;
+	}
+	free(cpath);
+	setvbuf(rr.log, NULL, _IOFBF, LOG_BUF_SIZE);
+
+	if (fread(magic, sizeof(magic), 1, rr.log) != 1 || magic[0] != REPLAY_MAGIC || magic[1] != REPLAY_VERSION ||
+	    get_varint(&len) || len >= NAMES_MAX || fread(names, 1, len, rr.log) != len) {
+		fprintf(stderr, "replay: %s: not a version %d log\n", path, REPLAY_VERSION);
+		return -1;
+	}
+	names[len] = '\0';
+
+	dev_names(have, sizeof(have));
+	if (strcmp(names, have)) {
+		fprintf(stderr, "replay: recorded with devices \"%s\", running with \"%s\"\n", names, have);
+		return -1;
+	}
+
+	rr.state_size = dev_state_size();
+	rr.state = malloc(rr.state_size + 1);
+	if (!rr.state)
+		return -1;
+
+	fseek(rr.ckpt, 0, SEEK_END);
+	size = ftell(rr.ckpt);
+	rewind(rr.ckpt);
+	if (fread(&hdr, sizeof(hdr), 1, rr.ckpt) != 1 || hdr.magic != REPLAY_MAGIC || hdr.version != REPLAY_VERSION ||
+	    hdr.state_max != rr.state_size) {
+		fprintf(stderr, "replay: %s.ckpt does not match this machine\n", path);
+		return -1;
+	}
+
+	/* Last checkpoint at or before @seek; the first is at the start */
+	if (find_ckpt(seek, size, &rec) || fread(rr.state, 1, rec.state_size, rr.ckpt) != rec.state_size ||
+	    fread(&rr.snap, sizeof(rr.snap), 1, rr.ckpt) != 1 || fseek(rr.log, rec.offset, SEEK_SET)) {
+		fprintf(stderr, "replay: %s.ckpt: short checkpoint\n", path);
+		return -1;
+	}
+
+	/* Devices first: the mapper must show the right banks before RAM goes back */
+	dev_restore(cpu, rr.state);
+	snapshot_restore(cpu, &rr.snap);
+	dev_touch(0, MEM_SIZE);
+	fuse_touch(0, MEM_SIZE);
+
+	replay_mode = REPLAY_PLAY;
+	rr.last = rec.cycle;
+	next_entry(cpu);
+
+	return 0;
+}
+
+int replay_running(const cpu_t *cpu)
+{
+	if (replay_done)
+		return 0;
+
+	/* The recording stopped before running this instruction */
+	return rr.next.kind != LOG_END || cpu->cycles < rr.next.cycle;
+}
+
+void replay_close(cpu_t *cpu)
+{
+	if (replay_mode == REPLAY_RECORD) {
+		put_entry(cpu, LOG_END);
+		if (fflush(rr.log) || ferror(rr.log) || fflush(rr.ckpt) || ferror(rr.ckpt))
+			perror("replay: write");
+	}
+
+	if (rr.log)
+		fclose(rr.log);
+	if (rr.ckpt)
+		fclose(rr.ckpt);
+	free(rr.state);
+
+	rr.log = NULL;
+	rr.ckpt = NULL;
+	rr.state = NULL;
+	replay_mode = REPLAY_OFF;
+}
+
+void replay_stop(void)
+{
+	replay_done = 1;
+}
+
+u16 replay_read(cpu_t *cpu, u16 addr, u16 value)
+{
+	if (replay_mode == REPLAY_RECORD) {
+		put_entry(cpu, LOG_READ);
+		put_varint(addr);
+		put_varint(value);
+		return value;
+	}
+
+	if (rr.next.kind != LOG_READ || rr.next.cycle != cpu->cycles || rr.next.addr != addr) {
+		diverged(cpu, "device read");
+		return 0;
+	}
+
+	value = rr.next.value;
+	next_entry(cpu);
+
+	return value;
+}
+
+void replay_irq(cpu_t *cpu, u16 vector)
+{
+	put_entry(cpu, LOG_IRQ);
+	put_varint(vector);
+}
+
+void replay_event(cpu_t *cpu, int dev)
+{
+	put_entry(cpu, LOG_EVENT);
+	put_varint(dev);
+}
+
+void replay_patch(cpu_t *cpu, u16 addr, const u8 *buf, u16 len)
+{
+	put_entry(cpu, LOG_PATCH);
+	put_varint(addr);
+	put_varint(len);
+	fwrite(buf, 1, len, rr.log);
+}
+
+u64 replay_service(cpu_t *cpu)
+{
+	if (replay_mode == REPLAY_RECORD) {
+		if (cpu->cycles >= rr.next_ckpt)
+			checkpoint(cpu);
+		return rr.next_ckpt;
+	}
+
+	while (!replay_done && rr.next.kind != LOG_READ && rr.next.cycle <= cpu->cycles) {
+		if (rr.next.cycle < cpu->cycles) {
+			diverged(cpu, "missed entry");
+			break;
+		}
+
+		switch (rr.next.kind) {
+		case LOG_IRQ:
+			dev_deliver(cpu, rr.next.value);
+			break;
+		case LOG_EVENT:
+			dev_run_event(cpu, rr.next.value);
+			break;
+		case LOG_PATCH:
+			cpu_mem_patch(cpu, rr.next.addr, rr.patch, rr.next.len);
+			break;
+		case LOG_END:
+			return DEV_NEVER;
+		default:
+			break;
+		}
+
+		next_entry(cpu);
+	}
+
+	/* A pending read is consumed by the access itself */
+	return rr.next.kind == LOG_READ ? DEV_NEVER : rr.next.cycle;
+}
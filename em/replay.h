@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Deterministic record and replay
+ *
+ * Everything the guest sees is a function of the machine state except device
+ * reads, interrupt delivery, device events (DMA completions) and hot patches.
+ * Recording logs just those, each stamped with the cycle it happened at, and
+ * replaying feeds them back in place of the devices. Entries are varints:
+ * (cycle delta << 3 | kind), then the payload.
+ *
+ * Full checkpoints (CPU, memory and device state) go to <log>.ckpt every
+ * interval cycles, as fixed-size records sorted by cycle. Replay seeks to a
+ * cycle by restoring the last checkpoint before it and running forward.
+ */
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <signal.h>
+#include "opcodes.h"
+
+#define REPLAY_MAGIC 0x5243534d /* "MSCR" */
+#define REPLAY_VERSION 3
+
+#define REPLAY_OFF 0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY 2
+
+extern int replay_mode;
+/* Set when the log ran out or diverged, or by replay_stop() */
+extern volatile sig_atomic_t replay_done;
+
+/* Log @cpu to @path from here on, checkpointing every @interval cycles */
+int replay_record(cpu_t *cpu, const char *path, u64 interval);
+/* Load the last checkpoint of @path at or before cycle @seek into @cpu */
+int replay_open(cpu_t *cpu, const char *path, u64 seek);
+/* Whether the replay has more to run at @cpu's cycle */
+int replay_running(const cpu_t *cpu);
+void replay_close(cpu_t *cpu);
+void replay_stop(void);
+
+/* Hooks for the device layer, see dev.c */
+u16 replay_read(cpu_t *cpu, u16 addr, u16 value);
+void replay_irq(cpu_t *cpu, u16 vector);
+void replay_event(cpu_t *cpu, int dev);
+void replay_patch(cpu_t *cpu, u16 addr, const u8 *buf, u16 len);
+/* Checkpoint or feed back due entries; returns the next cycle of interest */
+u64 replay_service(cpu_t *cpu);
+
+#endif /* _REPLAY_H_ */
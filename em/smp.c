@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "bus.h"
+#include "hotpatch.h"
+#include "smp.h"
+
+/* One cache line per core, so cores on different threads don't share one */
+struct smp_core {
+	cpu_t cpu;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
+static struct smp_core *cores;
+static int n_cores;
+static u64 quantum;
+static u64 limit;
+static pthread_barrier_t barrier;
+static int done; /* only written between quanta */
+static volatile sig_atomic_t stopped;
+static double elapsed;
+
+void smp_stop(void)
+{
+	stopped = 1;
+}
+
+static void smp_run_quantum(cpu_t *cpu)
+{
+	u64 end = cpu->cycles + quantum;
+
+	if (limit && end > limit)
+		end = limit;
+
+	while (cpu->cycles < end)
+		cpu_advance(cpu);
+}
+
+/* Between quanta, with every core stopped */
+static void smp_sync(void)
+{
+	if (atomic_load_explicit(&hotpatch_pending, memory_order_acquire))
+		hotpatch_apply(&cores[0].cpu);
+
+	done = stopped || (limit && cores[0].cpu.cycles >= limit);
+}
+
+static void *smp_thread(void *arg)
+{
+	cpu_t *cpu = arg;
+
+	while (!done) {
+		smp_run_quantum(cpu);
+
+		if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			smp_sync();
+		pthread_barrier_wait(&barrier);
+	}
+
+	return NULL;
+}
+
+static int smp_run_threads(void)
+{
+	int n;
+
+	if (pthread_barrier_init(&barrier, NULL, n_cores))
+		return -1;
+
+	for (n = 0; n < n_cores; n++) {
+		if (pthread_create(&cores[n].thread, NULL, smp_thread, &cores[n].cpu))
+			break;
+	}
+
+	/* The cores that did start would wait at the barrier forever */
+	if (n < n_cores) {
+		fprintf(stderr, "Could not start core %d\n", n);
+		exit(1);
+	}
+
+	for (n = 0; n < n_cores; n++)
+		pthread_join(cores[n].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+
+	return 0;
+}
+
+static void smp_run_deterministic(void)
+{
+	while (!done) {
+		for (int n = 0; n < n_cores; n++)
+			smp_run_quantum(&cores[n].cpu);
+
+		smp_sync();
+	}
+}
+
+int smp_run(cpu_t *boot, const struct smp_config *cfg)
+{
+	struct timespec t0, t1;
+	int ret = 0;
+
+	if (cfg->n_cores < 1 || cfg->n_cores > SMP_MAX_CORES || !cfg->quantum) {
+		fprintf(stderr, "Invalid core count or quantum\n");
+		return -1;
+	}
+
+	if (posix_memalign((void **)&cores, 64, cfg->n_cores * sizeof(*cores)))
+		return -1;
+
+	n_cores = cfg->n_cores;
+	quantum = cfg->quantum;
+	limit = cfg->limit;
+	done = 0;
+
+	for (int n = 0; n < n_cores; n++) {
+		cpu_t *cpu = &cores[n].cpu;
+
+		if (n == 0) {
+			*cpu = *boot;
+		} else {
+			cpu_init_shared(cpu, boot->memory);
+			cpu->trace = boot->trace;
+			cpu->features = boot->features;
+			cpu->a = n;
+			cpu->sp = boot->sp - n * SMP_STACK_SIZE;
+		}
+		cpu->features |= CPU_FEAT_ATOMIC;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (cfg->deterministic)
+		smp_run_deterministic();
+	else
+		ret = smp_run_threads();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	*boot = cores[0].cpu;
+
+	return ret;
+}
+
+void smp_report(FILE *fp)
+{
+	u64 total = 0;
+
+	for (int n = 0; n < n_cores; n++) {
+		cpu_t *cpu = &cores[n].cpu;
+
+		fprintf(fp, "core %2d: ip $%04x a=%04x b=%04x c=%04x d=%04x sp=%04x %llu insns\n", n, cpu->ip, cpu->a,
+			cpu->b, cpu->c, cpu->d, cpu->sp, cpu->cycles);
+		total += cpu->cycles;
+	}
+
+	fprintf(fp, "%llu insns in %.3f s (%.1f MIPS)\n", total, elapsed, elapsed > 0 ? total / elapsed / 1e6 : 0.0);
+}
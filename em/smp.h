@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Multi-core system
+ *
+ * N cores share one guest memory, each with its own registers. Core n starts
+ * at ip 0 with n in A and its stack at 0x1000 - n * SMP_STACK_SIZE, and has
+ * the XCHG/CAS extension enabled for synchronization.
+ *
+ * Cores run @quantum instructions at a time and then meet at a barrier, where
+ * hot patches are applied and the run is stopped. By default each core runs
+ * on its own host thread; in deterministic mode they take turns on one
+ * thread, so a run is reproducible for a given quantum.
+ */
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include <stdio.h>
+#include "opcodes.h"
+
+#define SMP_MAX_CORES 64
+#define SMP_STACK_SIZE 0x100
+
+struct smp_config {
+	int n_cores;
+	u64 quantum; /* instructions per core between barriers */
+	int deterministic;
+	u64 limit; /* instructions per core, 0 for no limit */
+};
+
+/* Run @boot and @cfg->n_cores - 1 more cores on its memory; @boot is core 0 */
+int smp_run(cpu_t *boot, const struct smp_config *cfg);
+void smp_stop(void);
+void smp_report(FILE *fp);
+
+#endif /* _SMP_H_ */
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <string.h>
+#include "snapshot.h"
+
+void snapshot_take(const cpu_t *cpu, snapshot_t *snap)
+{
+	memcpy(&snap->cpu, cpu, sizeof(*cpu));
+	memcpy(snap->memory, cpu->memory, MEM_SIZE);
+}
+
+void snapshot_restore_cpu(cpu_t *cpu, const cpu_t *saved)
+{
+	/* Host-side attachments are not part of the machine state */
+	u8 *memory = cpu->memory;
+	u8 *cov_map = cpu->cov_map;
+	u8 trace = cpu->trace;
+	const struct mem_alloc *alloc = cpu->alloc;
+
+	memcpy(cpu, saved, sizeof(*cpu));
+
+	cpu->memory = memory;
+	cpu->cov_map = cov_map;
+	cpu->trace = trace;
+	cpu->alloc = alloc;
+	cpu->cov_prev = 0;
+}
+
+void snapshot_restore(cpu_t *cpu, const snapshot_t *snap)
+{
+	snapshot_restore_cpu(cpu, &snap->cpu);
+	memcpy(cpu->memory, snap->memory, MEM_SIZE);
+}
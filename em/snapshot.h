@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* In-memory machine snapshots
+ *
+ * A snapshot holds the complete architectural state, so restoring one puts
+ * the machine back exactly where it was when the snapshot was taken.
+ */
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "opcodes.h"
+
+typedef struct snapshot {
+	cpu_t cpu;
+	u8 memory[MEM_SIZE];
+} snapshot_t;
+
+void snapshot_take(const cpu_t *cpu, snapshot_t *snap);
+void snapshot_restore(cpu_t *cpu, const snapshot_t *snap);
+/* Registers only, keeping @cpu's memory and other host attachments */
+void snapshot_restore_cpu(cpu_t *cpu, const cpu_t *saved);
+
+#endif /* _SNAPSHOT_H_ */
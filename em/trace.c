@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include "disasm.h"
+#include "trace.h"
+
+#define TRACE_BUF_SIZE (1 << 20)
+
+static FILE *trace_fp;
+
+static void trace_close(void)
+{
+	fclose(trace_fp);
+}
+
+int trace_open(const char *path, u16 features)
+{
+	struct trace_hdr hdr = { TRACE_MAGIC, TRACE_VERSION, features };
+
+	trace_fp = fopen(path, "wb");
+	if (!trace_fp || setvbuf(trace_fp, NULL, _IOFBF, TRACE_BUF_SIZE) ||
+	    fwrite(&hdr, sizeof(hdr), 1, trace_fp) != 1) {
+		perror(path);
+		return -1;
+	}
+
+	/* Whichever way main() returns */
+	atexit(trace_close);
+
+	return 0;
+}
+
+/* One fwrite() per instruction keeps the records of several cores whole */
+void trace_insn(const cpu_t *cpu, u16 ip, u16 opcode)
+{
+	u16 operand = cpu->memory[(u16)(ip + 2)] | (cpu->memory[(u16)(ip + 3)] << 8);
+	char line[DISASM_LINE_MAX];
+
+	if (trace_fp) {
+		struct trace_rec rec = { ip, opcode, operand };
+
+		fwrite(&rec, sizeof(rec), 1, trace_fp);
+		return;
+	}
+
+	fwrite(line, 1, disasm_line(ip, opcode, operand, cpu->features, line), stdout);
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Instruction traces
+ *
+ * With cpu->trace set, every instruction is traced before it runs: as a line
+ * of disassembly on stdout, or, once trace_open() has been called, as a
+ * binary record in a file. Writing records keeps up with the emulator where
+ * printing does not; disasm_trace() turns them into the same lines later.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "opcodes.h"
+
+#define TRACE_MAGIC 0x5443534d /* "MSCT" */
+#define TRACE_VERSION 1
+
+struct trace_hdr {
+	u32 magic;
+	u16 version;
+	u16 features; /* of the CPU that was traced */
+};
+
+/* The opcode and the word after it, as they were before it ran */
+struct trace_rec {
+	u16 ip;
+	u16 opcode;
+	u16 operand;
+};
+
+/* Trace to @path from now on; it is flushed when the program exits */
+int trace_open(const char *path, u16 features);
+void trace_insn(const cpu_t *cpu, u16 ip, u16 opcode);
+
+#endif /* _TRACE_H_ */
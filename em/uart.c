@@ -0,0 +1,452 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Serial console
+ *
+ * The CPU and the host side only meet in two single-producer single-consumer
+ * rings, so guest accesses never make a system call. A host thread moves
+ * bytes between the rings and the backend: it sleeps in epoll_wait() on the
+ * input and an eventfd, writes transmit data out in as few write()s as the
+ * backend takes, and raises the receive interrupt.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "bus.h"
+#include "dev.h"
+
+#define RING_SIZE 0x10000 /* power of two */
+#define UART_POLL_MS 10 /* input retry interval while the receive ring is full */
+#define UART_FLUSH_MS 1000
+
+struct ring {
+	_Alignas(64) atomic_uint head; /* written by the producer */
+	_Alignas(64) atomic_uint tail; /* written by the consumer */
+	u8 buf[RING_SIZE];
+};
+
+static struct {
+	device_t dev;
+	struct ring rx;
+	struct ring tx;
+
+	int in_fd;
+	int out_fd;
+	int ev_fd;
+	int in_flags; /* stdin file status flags to restore, or -1 */
+	atomic_int sleeping; /* the host thread may be in epoll_wait() */
+	_Atomic(cpu_t *) irq_cpu; /* core that last wrote CTRL */
+
+	u16 ctrl;
+	u16 vec;
+	u16 tx_addr;
+	u16 tx_len;
+	atomic_int overrun;
+} uart;
+
+/* Contiguous bytes the consumer can take */
+static u32 ring_peek(struct ring *r, u8 **p)
+{
+	u32 tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	u32 used = atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+	u32 off = tail & (RING_SIZE - 1);
+
+	*p = &r->buf[off];
+	return used < RING_SIZE - off ? used : RING_SIZE - off;
+}
+
+static void ring_consume(struct ring *r, u32 n)
+{
+	atomic_fetch_add_explicit(&r->tail, n, memory_order_release);
+}
+
+/* Contiguous free space the producer can fill */
+static u32 ring_space(struct ring *r, u8 **p)
+{
+	u32 head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	u32 free = RING_SIZE - (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+	u32 off = head & (RING_SIZE - 1);
+
+	*p = &r->buf[off];
+	return free < RING_SIZE - off ? free : RING_SIZE - off;
+}
+
+static void ring_commit(struct ring *r, u32 n)
+{
+	atomic_fetch_add_explicit(&r->head, n, memory_order_release);
+}
+
+static int ring_empty(struct ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) == atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* Queue up to @n bytes; returns how many fit */
+static u32 ring_push(struct ring *r, const u8 *src, u32 n)
+{
+	u32 done = 0;
+	u8 *p;
+
+	while (done < n) {
+		u32 chunk = ring_space(r, &p);
+
+		if (!chunk)
+			break;
+		if (chunk > n - done)
+			chunk = n - done;
+
+		memcpy(p, src + done, chunk);
+		ring_commit(r, chunk);
+		done += chunk;
+	}
+
+	return done;
+}
+
+static void uart_wake(void)
+{
+	u64 one = 1;
+
+	/*
+	 * Pairs with the fence in uart_thread(): either it sees the bytes just
+	 * committed, or we see it sleeping. Release alone would let this load
+	 * pass the head update and both sides miss each other.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	/* One write per sleep of the host thread, not per byte */
+	if (atomic_load(&uart.sleeping) && atomic_exchange(&uart.sleeping, 0))
+		write(uart.ev_fd, &one, sizeof(one));
+}
+
+static void uart_rx_irq(void)
+{
+	cpu_t *cpu = atomic_load(&uart.irq_cpu);
+
+	if (cpu && (uart.ctrl & UART_CTRL_RX_IRQ) && !ring_empty(&uart.rx))
+		dev_raise_irq(&uart.dev, cpu, uart.vec);
+}
+
+/* Queue guest memory, which may wrap around the end of the address space */
+static u16 uart_send(cpu_t *cpu, u16 addr, u16 len)
+{
+	u32 first = MEM_SIZE - addr < len ? MEM_SIZE - addr : len;
+	u32 n = ring_push(&uart.tx, &cpu->memory[addr], first);
+
+	if (n == first && len > first)
+		n += ring_push(&uart.tx, cpu->memory, len - first);
+	if (n < len)
+		atomic_store(&uart.overrun, 1);
+	if (n)
+		uart_wake();
+
+	return n;
+}
+
+static u16 uart_read(device_t *dev, cpu_t *cpu, u16 addr)
+{
+	u16 status = 0;
+	u8 *p;
+
+	switch ((addr - UART_BASE) & ~1) {
+	case UART_RX:
+		if (!ring_peek(&uart.rx, &p))
+			return 0;
+		u8 c = *p;
+		ring_consume(&uart.rx, 1);
+		/* Level-triggered: stay pending while bytes are left */
+		uart_rx_irq();
+		return c;
+	case UART_STATUS:
+		if (!ring_empty(&uart.rx))
+			status |= UART_STATUS_RX;
+		if (!ring_space(&uart.tx, &p))
+			status |= UART_STATUS_TX_FULL;
+		if (atomic_exchange(&uart.overrun, 0))
+			status |= UART_STATUS_OVERRUN;
+		return status;
+	case UART_CTRL:
+		return uart.ctrl;
+	case UART_VEC:
+		return uart.vec;
+	case UART_TX_ADDR:
+		return uart.tx_addr;
+	case UART_TX_LEN:
+		return uart.tx_len;
+	default:
+		return 0;
+	}
+}
+
+static void uart_write(device_t *dev, cpu_t *cpu, u16 addr, u16 value)
+{
+	u8 c = value & 0xFF;
+
+	switch ((addr - UART_BASE) & ~1) {
+	case UART_TX:
+		if (ring_push(&uart.tx, &c, 1))
+			uart_wake();
+		else
+			atomic_store(&uart.overrun, 1);
+		break;
+	case UART_CTRL:
+		uart.ctrl = value & UART_CTRL_RX_IRQ;
+		atomic_store(&uart.irq_cpu, cpu);
+		uart_rx_irq();
+		break;
+	case UART_VEC:
+		uart.vec = value;
+		break;
+	case UART_TX_ADDR:
+		uart.tx_addr = value;
+		break;
+	case UART_TX_LEN:
+		uart.tx_len = uart_send(cpu, uart.tx_addr, value);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Returns -1 while the backend can't take more */
+static int uart_drain(void)
+{
+	u8 *p;
+	u32 n;
+
+	while ((n = ring_peek(&uart.tx, &p))) {
+		ssize_t ret = write(uart.out_fd, p, n);
+
+		if (ret > 0) {
+			ring_consume(&uart.tx, ret);
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return -1;
+
+		/* Nobody is listening; drop the output rather than stall */
+		ring_consume(&uart.tx, n);
+	}
+
+	return 0;
+}
+
+/* Returns 0 at end of input */
+static int uart_fill(void)
+{
+	u8 *p;
+	u32 n = ring_space(&uart.rx, &p);
+
+	if (!n)
+		return 1;
+
+	ssize_t ret = read(uart.in_fd, p, n);
+	if (ret > 0) {
+		ring_commit(&uart.rx, ret);
+		uart_rx_irq();
+	}
+
+	return ret > 0 || (ret < 0 && (errno == EAGAIN || errno == EINTR));
+}
+
+/* Move @fd from the @cur event mask to @want */
+static int uart_watch(int ep, int fd, u32 *cur, u32 want)
+{
+	struct epoll_event ev = { .events = want, .data.fd = fd };
+	int ret = 0;
+
+	if (want == *cur)
+		return 0;
+
+	if (!*cur)
+		ret = epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+	else if (!want)
+		ret = epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+	else
+		ret = epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+
+	if (!ret)
+		*cur = want;
+
+	return ret;
+}
+
+static void *uart_thread(void *arg)
+{
+	int ep = epoll_create1(0);
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = uart.ev_fd };
+	int in_open = 1;
+	int in_poll = 1; /* regular files can't be polled and are always ready */
+	u32 in_ev = 0, out_ev = 0;
+
+	epoll_ctl(ep, EPOLL_CTL_ADD, uart.ev_fd, &ev);
+
+	for (;;) {
+		struct epoll_event events[3];
+		u8 *p;
+		int blocked = uart_drain();
+		int rx_full = !ring_space(&uart.rx, &p);
+		u32 want_in = in_open && in_poll && !rx_full ? EPOLLIN : 0;
+		u32 want_out = blocked ? EPOLLOUT : 0;
+
+		if (uart.in_fd == uart.out_fd) {
+			if (uart_watch(ep, uart.in_fd, &in_ev, want_in | want_out) && errno == EPERM)
+				in_poll = 0;
+		} else {
+			if (uart_watch(ep, uart.in_fd, &in_ev, want_in) && errno == EPERM)
+				in_poll = 0;
+			uart_watch(ep, uart.out_fd, &out_ev, want_out);
+		}
+
+		atomic_store(&uart.sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!blocked && !ring_empty(&uart.tx)) {
+			atomic_store(&uart.sleeping, 0);
+			continue;
+		}
+
+		/* Poll when the input can't wake us: ring full or not pollable */
+		int timeout = !in_open ? -1 : rx_full ? UART_POLL_MS : in_poll ? -1 : 0;
+		int n = epoll_wait(ep, events, 3, timeout);
+		atomic_store(&uart.sleeping, 0);
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == uart.ev_fd) {
+				u64 count;
+				read(uart.ev_fd, &count, sizeof(count));
+			} else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && in_open && !uart_fill()) {
+				in_open = 0;
+			}
+		}
+
+		if (in_open && !in_poll && !uart_fill())
+			in_open = 0;
+	}
+
+	return NULL;
+}
+
+/* Give the host thread a moment to write out what the guest sent last */
+static void uart_flush(void)
+{
+	for (int ms = 0; ms < UART_FLUSH_MS && !ring_empty(&uart.tx); ms++) {
+		uart_wake();
+		usleep(1000);
+	}
+
+	/* The shell shares stdin's file description */
+	if (uart.in_flags != -1)
+		fcntl(uart.in_fd, F_SETFL, uart.in_flags);
+}
+
+static int uart_open(const char *spec)
+{
+	if (!strcmp(spec, "stdio")) {
+		uart.in_fd = STDIN_FILENO;
+		uart.out_fd = STDOUT_FILENO;
+		uart.in_flags = fcntl(uart.in_fd, F_GETFL);
+		fcntl(uart.in_fd, F_SETFL, uart.in_flags | O_NONBLOCK);
+		return 0;
+	}
+
+	if (!strcmp(spec, "pty")) {
+		int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+		if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+			perror("uart: pty");
+			return -1;
+		}
+		fprintf(stderr, "uart: %s\n", ptsname(fd));
+		uart.in_fd = uart.out_fd = fd;
+
+		/* Hold the slave open so the master doesn't hang up between clients */
+		if (open(ptsname(fd), O_RDWR | O_NOCTTY) < 0) {
+			perror("uart: pty");
+			return -1;
+		}
+		return 0;
+	}
+
+	/* O_RDWR keeps a FIFO open without a peer */
+	int fd = open(spec, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		perror(spec);
+		return -1;
+	}
+	uart.in_fd = uart.out_fd = fd;
+
+	return 0;
+}
+
+/* Registers only: ring contents belong to the host side */
+static size_t uart_save(device_t *dev, u8 *buf)
+{
+	u16 regs[] = { uart.ctrl, uart.vec, uart.tx_addr, uart.tx_len };
+
+	memcpy(buf, regs, sizeof(regs));
+
+	return sizeof(regs);
+}
+
+static size_t uart_restore(device_t *dev, cpu_t *cpu, const u8 *buf)
+{
+	u16 regs[4];
+
+	memcpy(regs, buf, sizeof(regs));
+	uart.ctrl = regs[0];
+	uart.vec = regs[1];
+	uart.tx_addr = regs[2];
+	uart.tx_len = regs[3];
+
+	atomic_store(&uart.irq_cpu, cpu);
+	uart_rx_irq();
+
+	return sizeof(regs);
+}
+
+int uart_init(const char *spec)
+{
+	pthread_t thread;
+
+	uart.in_flags = -1;
+	if (uart_open(spec))
+		return -1;
+
+	/* A reader going away shows up as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	uart.ev_fd = eventfd(0, EFD_NONBLOCK);
+	if (uart.ev_fd < 0) {
+		perror("uart: eventfd");
+		return -1;
+	}
+
+	uart.dev = (device_t){
+		.name = "uart",
+		.base = UART_BASE,
+		.size = UART_TX_LEN + 2,
+		.read = uart_read,
+		.write = uart_write,
+		.state_size = 4 * sizeof(u16),
+		.save = uart_save,
+		.restore = uart_restore,
+	};
+	if (dev_register(&uart.dev))
+		return -1;
+
+	if (pthread_create(&thread, NULL, uart_thread, NULL))
+		return -1;
+	pthread_detach(thread);
+	atexit(uart_flush);
+
+	return 0;
+}
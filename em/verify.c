@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <string.h>
+#include "bus.h"
+#include "disasm.h"
+#include "fuse.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "verify.h"
+
+#define VERIFY_BYTES_MAX 16 /* differing memory bytes shown */
+
+/* Instructions the reference ran last, oldest first from n_history */
+static struct trace_rec history[VERIFY_HISTORY];
+static u64 n_history;
+
+static void ref_advance(cpu_t *ref)
+{
+	struct trace_rec *rec = &history[n_history++ % VERIFY_HISTORY];
+	u16 ip = ref->ip;
+
+	rec->ip = ip;
+	rec->opcode = ref->memory[ip] | (ref->memory[(u16)(ip + 1)] << 8);
+	rec->operand = ref->memory[(u16)(ip + 2)] | (ref->memory[(u16)(ip + 3)] << 8);
+	cpu_advance(ref);
+}
+
+static int regs_differ(const cpu_t *ref, const cpu_t *cpu)
+{
+	return ref->r64 != cpu->r64 || ref->ip != cpu->ip || ref->sp != cpu->sp || cpu_flags(ref) != cpu_flags(cpu);
+}
+
+static void report_field(FILE *fp, const char *name, u16 ref, u16 fast)
+{
+	if (ref != fast)
+		fprintf(fp, "  %-6s %04x       %04x\n", name, ref, fast);
+}
+
+static void report(const cpu_t *ref, const cpu_t *cpu, u16 block, FILE *fp)
+{
+	char line[DISASM_LINE_MAX];
+	int n = 0;
+
+	fprintf(fp, "verify: diverged at cycle %llu, after the block at $%04x\n", cpu->cycles, block);
+	fprintf(fp, "  %-6s reference  fuse\n", "");
+	report_field(fp, "a", ref->a, cpu->a);
+	report_field(fp, "b", ref->b, cpu->b);
+	report_field(fp, "c", ref->c, cpu->c);
+	report_field(fp, "d", ref->d, cpu->d);
+	report_field(fp, "sp", ref->sp, cpu->sp);
+	report_field(fp, "ip", ref->ip, cpu->ip);
+	report_field(fp, "flags", cpu_flags(ref), cpu_flags(cpu));
+
+	for (u32 addr = 0; addr < MEM_SIZE && n < VERIFY_BYTES_MAX; addr++) {
+		if (ref->memory[addr] == cpu->memory[addr])
+			continue;
+		fprintf(fp, "  $%04x  %02x         %02x\n", addr, ref->memory[addr], cpu->memory[addr]);
+		n++;
+	}
+
+	fprintf(fp, "verify: last instructions of the reference:\n");
+	for (u64 i = n_history > VERIFY_HISTORY ? n_history - VERIFY_HISTORY : 0; i < n_history; i++) {
+		const struct trace_rec *rec = &history[i % VERIFY_HISTORY];
+
+		disasm_line(rec->ip, rec->opcode, rec->operand, ref->features, line);
+		fputs(line, fp);
+	}
+}
+
+int verify_run(cpu_t *cpu, u64 limit, u64 interval, FILE *fp)
+{
+	static cpu_t ref;
+	u64 blocks = 0;
+	u64 next_check = interval;
+	u16 block = cpu->ip;
+	int ret = 0;
+
+	if (cpu_init(&ref)) {
+		perror("verify");
+		return -1;
+	}
+	snapshot_restore_cpu(&ref, cpu);
+	memcpy(ref.memory, cpu->memory, MEM_SIZE);
+	cpu->trace = 0;
+	ref.trace = 0;
+
+	while ((!limit || cpu->cycles < limit) && !replay_done) {
+		int check_memory = interval && cpu->cycles >= next_check;
+
+		block = cpu->ip;
+		fuse_advance(cpu, limit);
+		while (ref.cycles < cpu->cycles)
+			ref_advance(&ref);
+		blocks++;
+
+		if (check_memory)
+			next_check = cpu->cycles + interval;
+
+		if (unlikely(regs_differ(&ref, cpu)) || (check_memory && memcmp(ref.memory, cpu->memory, MEM_SIZE))) {
+			report(&ref, cpu, block, fp);
+			ret = 1;
+			break;
+		}
+	}
+
+	if (!ret && memcmp(ref.memory, cpu->memory, MEM_SIZE)) {
+		report(&ref, cpu, block, fp);
+		ret = 1;
+	}
+
+	if (!ret)
+		fprintf(fp, "verify: %llu instructions in %llu blocks match\n", cpu->cycles, blocks);
+	cpu_free(&ref);
+
+	return ret;
+}
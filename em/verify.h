@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Lockstep verification of the predecoded engine
+ *
+ * The guest runs under fuse_advance() while a second machine, on its own copy
+ * of memory, runs the same instructions through cpu_advance(). After every
+ * block the registers, ip and flags of the two are compared, and every
+ * interval cycles their memory is. The first difference stops the run with
+ * the fields that differ and the instructions leading up to it.
+ *
+ * Devices would see every access twice, so the guest runs without them.
+ */
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stdio.h>
+#include "opcodes.h"
+
+#define VERIFY_HISTORY 32 /* instructions shown before a divergence */
+
+/* Run @cpu for up to @limit instructions (0: forever). Returns 1 if it diverged */
+int verify_run(cpu_t *cpu, u64 limit, u64 interval, FILE *fp);
+
+#endif /* _VERIFY_H_ */
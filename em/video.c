@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "dev.h"
+#include "video.h"
+
+_Static_assert(VIDEO_HEIGHT <= 32, "one dirty bit per row");
+
+static struct video_hdr *hdr;
+static device_t video_dev;
+
+static void video_mark(u16 addr, u32 len)
+{
+	u32 lo = addr < VIDEO_BASE ? VIDEO_BASE : addr;
+	u32 hi = addr + len > VIDEO_BASE + VIDEO_SIZE ? VIDEO_BASE + VIDEO_SIZE : addr + len;
+
+	if (lo >= hi)
+		return;
+
+	u32 first = (lo - VIDEO_BASE) / VIDEO_PITCH;
+	u32 last = (hi - 1 - VIDEO_BASE) / VIDEO_PITCH;
+	uint32_t rows = (last - first == 31 ? ~0u : ((1u << (last - first + 1)) - 1)) << first;
+
+	/* Full barrier: the display must not take the bit before the pixels */
+	if ((__atomic_fetch_or(&hdr->dirty, rows, __ATOMIC_SEQ_CST) & rows) != rows)
+		__atomic_fetch_add(&hdr->generation, 1, __ATOMIC_RELEASE);
+}
+
+static void video_write(device_t *dev, cpu_t *cpu, u16 addr, u16 value)
+{
+	cpu->memory[addr] = value & 0xFF;
+	cpu->memory[(u16)(addr + 1)] = value >> 8;
+	video_mark(addr, 2);
+}
+
+static void video_touch(device_t *dev, u16 addr, u32 len)
+{
+	video_mark(addr, len);
+}
+
+int video_init(cpu_t *cpu, const char *name)
+{
+	u8 *fb = cpu->memory + VIDEO_BASE;
+	u8 saved[VIDEO_SIZE];
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (VIDEO_BASE % page || VIDEO_PIXELS_OFFSET % page || VIDEO_SIZE % page) {
+		fprintf(stderr, "video: unsupported host page size %ld\n", page);
+		return -1;
+	}
+
+	int fd = shm_open(name ? name : VIDEO_SHM_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+
+	if (ftruncate(fd, VIDEO_SHM_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	hdr = mmap(NULL, VIDEO_PIXELS_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+
+	/* Replace the guest framebuffer pages, keeping what the image put there */
+	memcpy(saved, fb, VIDEO_SIZE);
+	if (mmap(fb, VIDEO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, VIDEO_PIXELS_OFFSET) == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	memcpy(fb, saved, VIDEO_SIZE);
+	close(fd);
+
+	hdr->width = VIDEO_WIDTH;
+	hdr->height = VIDEO_HEIGHT;
+	__atomic_store_n(&hdr->dirty, ~0u, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hdr->generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->magic, VIDEO_MAGIC, __ATOMIC_RELEASE);
+
+	video_dev = (device_t){
+		.name = "video",
+		.base = VIDEO_BASE,
+		.size = VIDEO_SIZE,
+		.mapped = 1,
+		.write = video_write,
+		.touch = video_touch,
+	};
+
+	return dev_register(&video_dev);
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Framebuffer shared with the display
+ *
+ * The guest framebuffer is a page of guest memory that the emulator maps from
+ * a POSIX shared memory object, so the display reads the pixels in place. A
+ * header page in front of it holds a dirty-row bitmap: the emulator sets the
+ * bit of every row it writes and the display clears the bits of the rows it
+ * uploads.
+ */
+#ifndef _VIDEO_H_
+#define _VIDEO_H_
+
+#include <stdint.h>
+
+#define VIDEO_SHM_NAME "/msc16-video"
+#define VIDEO_SHM_INSTANCE "/msc16-video.%u" /* em.bin -v n, for tiled displays */
+#define VIDEO_MAGIC 0x5643534d /* "MSCV" */
+
+#define VIDEO_BASE 0xE000 /* guest address */
+#define VIDEO_WIDTH 64
+#define VIDEO_HEIGHT 32
+#define VIDEO_PITCH (VIDEO_WIDTH * 2) /* RGB565, little-endian */
+#define VIDEO_SIZE (VIDEO_PITCH * VIDEO_HEIGHT)
+
+#define VIDEO_PIXELS_OFFSET 0x1000 /* offset of the pixels in the object */
+#define VIDEO_SHM_SIZE (VIDEO_PIXELS_OFFSET + VIDEO_SIZE)
+
+struct video_hdr {
+	uint32_t magic;
+	uint16_t width;
+	uint16_t height;
+	uint32_t generation; /* bumped whenever a clean row turns dirty */
+	uint32_t dirty; /* bit n: row n changed since the display last took it */
+};
+
+#endif /* _VIDEO_H_ */
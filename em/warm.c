@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dev.h"
+#include "fuse.h"
+#include "mem.h"
+#include "snapshot.h"
+#include "warm.h"
+
+#define WARM_PAGE 0x1000
+#define NAMES_MAX 256
+
+/* First page of the image; memory follows, then the device state */
+struct warm_hdr {
+	u32 magic;
+	u32 version;
+	u32 cpu_size;
+	u32 mem_size;
+	u64 mem_offset;
+	u64 state_offset;
+	u64 state_size;
+	char devices[NAMES_MAX];
+	cpu_t cpu;
+};
+
+_Static_assert(sizeof(struct warm_hdr) <= WARM_PAGE, "header fits its page");
+
+volatile sig_atomic_t warm_request;
+
+static device_t warm_dev;
+
+static void warm_write(device_t *dev, cpu_t *cpu, u16 addr, u16 value)
+{
+	if (addr == WARM_BASE + WARM_DONE && value == WARM_MAGIC)
+		warm_request = 1;
+}
+
+int warm_init(void)
+{
+	warm_dev = (device_t){
+		.name = "warm",
+		.base = WARM_BASE,
+		.size = WARM_DONE + 2,
+		.write = warm_write,
+	};
+
+	return dev_register(&warm_dev);
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n <= 0)
+			return -1;
+		buf = (const u8 *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+int warm_save(const cpu_t *cpu, const char *path)
+{
+	static struct warm_hdr hdr;
+	u8 *state = malloc(dev_state_size() + 1);
+	char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+	int fd = -1, ret = -1;
+
+	if (!state || !tmp)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = WARM_IMAGE_MAGIC;
+	hdr.version = WARM_VERSION;
+	hdr.cpu_size = sizeof(cpu_t);
+	hdr.mem_size = MEM_SIZE;
+	hdr.mem_offset = WARM_PAGE;
+	hdr.state_offset = WARM_PAGE + MEM_SIZE;
+	dev_names(hdr.devices, sizeof(hdr.devices));
+	hdr.cpu = *cpu;
+	hdr.state_size = dev_save(state);
+
+	/* Written aside and renamed, so a reader never sees half an image */
+	strcat(strcpy(tmp, path), ".tmp");
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || write_all(fd, &hdr, sizeof(hdr), 0) || write_all(fd, cpu->memory, MEM_SIZE, hdr.mem_offset) ||
+	    write_all(fd, state, hdr.state_size, hdr.state_offset) || close(fd) || rename(tmp, path)) {
+		perror(path);
+		if (fd >= 0)
+			unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(state);
+	free(tmp);
+
+	return ret;
+}
+
+static int page_mapped(u32 addr)
+{
+	return dev_map[addr >> 8] && dev_map[addr >> 8]->mapped;
+}
+
+/*
+ * Private file pages in place of the anonymous ones, around the pages a
+ * device has mapped itself (the framebuffer), which are copied into instead
+ */
+static void warm_map(cpu_t *cpu, int fd, const u8 *file, u64 offset)
+{
+	for (u32 addr = 0, end; addr < MEM_SIZE; addr = end) {
+		int mapped = page_mapped(addr);
+
+		for (end = addr + WARM_PAGE; end < MEM_SIZE && page_mapped(end) == mapped; end += WARM_PAGE)
+			;
+
+		if (mapped || cpu->alloc != &mem_anon ||
+		    mmap(cpu->memory + addr, end - addr, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+			 offset + addr) == MAP_FAILED)
+			memcpy(cpu->memory + addr, file + offset + addr, end - addr);
+	}
+}
+
+int warm_load(cpu_t *cpu, const char *path)
+{
+	char names[NAMES_MAX];
+	const struct warm_hdr *hdr;
+	struct stat st;
+	u8 *file;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		return -1;
+	}
+
+	if (st.st_size < (off_t)sizeof(*hdr) ||
+	    (file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "warm: %s: not an image\n", path);
+		close(fd);
+		return -1;
+	}
+
+	hdr = (const struct warm_hdr *)file;
+	dev_names(names, sizeof(names));
+	if (hdr->magic != WARM_IMAGE_MAGIC || hdr->version != WARM_VERSION || hdr->cpu_size != sizeof(cpu_t) ||
+	    hdr->mem_size != MEM_SIZE || hdr->state_size > dev_state_size() ||
+	    hdr->state_offset + hdr->state_size > (u64)st.st_size || strncmp(hdr->devices, names, NAMES_MAX)) {
+		fprintf(stderr, "warm: %s: not a version %d image for this build and devices (%s)\n", path,
+			WARM_VERSION, names);
+		munmap(file, st.st_size);
+		close(fd);
+		return -1;
+	}
+
+	warm_map(cpu, fd, file, hdr->mem_offset);
+
+	/* After the memory: the mapper puts its windows back over it */
+	dev_restore(cpu, file + hdr->state_offset);
+	snapshot_restore_cpu(cpu, &hdr->cpu);
+	cpu->next_event = 0;
+
+	dev_touch(0, MEM_SIZE);
+	fuse_touch(0, MEM_SIZE);
+
+	munmap(file, st.st_size);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Warm-start machine images
+ *
+ * Once the guest says its initialization is done, by storing WARM_MAGIC to
+ * WARM_BASE or by reaching a given address, the whole machine is written out:
+ * registers, memory, device registers and pending events and interrupts.
+ * Starting from the image skips the initialization. Its memory is page
+ * aligned in the file and mapped copy-on-write, so nothing is read up front.
+ *
+ * The image is only valid for the same emulator build and the same devices.
+ */
+#ifndef _WARM_H_
+#define _WARM_H_
+
+#include <signal.h>
+#include "opcodes.h"
+
+#define WARM_IMAGE_MAGIC 0x5743534d /* "MSCW" */
+#define WARM_VERSION 2
+
+/* Set by a store of WARM_MAGIC to WARM_DONE */
+extern volatile sig_atomic_t warm_request;
+
+int warm_save(const cpu_t *cpu, const char *path);
+/* Replace the state of @cpu and the devices with the image at @path */
+int warm_load(cpu_t *cpu, const char *path);
+
+#endif /* _WARM_H_ */
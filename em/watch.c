@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "watch.h"
+
+#define EFLAGS_TF 0x100
+#define STEP_PAGES_MAX 2
+
+struct watch {
+	u16 addr;
+	u16 len;
+	int mode;
+};
+
+volatile sig_atomic_t watch_break;
+
+static cpu_t *watch_cpu;
+static struct watch watches[WATCH_MAX];
+static int n_watches;
+static long page_size;
+
+/*
+ * Host pages made writable for the instruction being single-stepped; a store
+ * that straddles two protected pages faults on each before it completes.
+ */
+static u8 *step_pages[STEP_PAGES_MAX];
+static int n_step_pages;
+/* Watched bytes of the step pages as they were before the store */
+static u8 before[MEM_SIZE];
+/* Watches already reported for this store, by bit */
+static u64 step_hits;
+_Static_assert(WATCH_MAX <= 64, "step_hits holds a bit per watch");
+
+static int page_watched(size_t page)
+{
+	for (int i = 0; i < n_watches; i++) {
+		size_t first = watches[i].addr / page_size;
+		size_t last = (watches[i].addr + watches[i].len - 1) / page_size;
+
+		if (page >= first && page <= last)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void protect_page(size_t page, int prot)
+{
+	mprotect(watch_cpu->memory + page * page_size, page_size, prot);
+}
+
+/* The part of watch @i on host page @page, empty if @begin >= @end */
+static void watch_span(int i, size_t page, u32 *begin, u32 *end)
+{
+	u32 page_begin = page * page_size;
+	u32 page_end = page_begin + page_size;
+
+	*begin = watches[i].addr > page_begin ? watches[i].addr : page_begin;
+	*end = watches[i].addr + watches[i].len < page_end ? watches[i].addr + watches[i].len : page_end;
+}
+
+/* Async-signal-safe "watch: write to $xxxx (ip $xxxx)" */
+static void report(u16 addr, u16 ip)
+{
+	static const char hex[] = "0123456789abcdef";
+	char msg[] = "watch: write to $xxxx (ip $xxxx)\n";
+	char *a = strchr(msg, 'x');
+	char *b = strrchr(msg, '$') + 1;
+
+	for (int i = 0; i < 4; i++) {
+		a[i] = hex[(addr >> (12 - 4 * i)) & 0xF];
+		b[i] = hex[(ip >> (12 - 4 * i)) & 0xF];
+	}
+
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+}
+
+static void watch_hit(int i, u16 addr)
+{
+	report(addr, watch_cpu->ip);
+	if (watches[i].mode == WATCH_BREAK)
+		watch_break = 1;
+	step_hits |= 1ULL << i;
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *uctx)
+{
+	ucontext_t *uc = uctx;
+	u8 *fault = info->si_addr;
+
+	if (!watch_cpu || fault < watch_cpu->memory || fault >= watch_cpu->memory + MEM_SIZE ||
+	    n_step_pages == STEP_PAGES_MAX) {
+		/* Not ours: let the fault happen for real */
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	u16 addr = fault - watch_cpu->memory;
+	size_t page = addr / page_size;
+
+	/*
+	 * si_addr is only where the store starts; a wide or repeated store
+	 * (FILL, MOVS, DMA) may change watched bytes further on, which
+	 * trap_handler() finds by comparing against these.
+	 */
+	for (int i = 0; i < n_watches; i++) {
+		u32 begin, end;
+
+		watch_span(i, page, &begin, &end);
+		if (begin < end)
+			memcpy(before + begin, watch_cpu->memory + begin, end - begin);
+	}
+
+	for (int i = 0; i < n_watches; i++) {
+		if (addr >= watches[i].addr && addr - watches[i].addr < watches[i].len && !(step_hits & (1ULL << i))) {
+			watch_hit(i, addr);
+			break;
+		}
+	}
+
+	step_pages[n_step_pages++] = watch_cpu->memory + page * page_size;
+	mprotect(watch_cpu->memory + page * page_size, page_size, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+static void trap_handler(int sig, siginfo_t *info, void *uctx)
+{
+	ucontext_t *uc = uctx;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+	for (int p = 0; p < n_step_pages; p++) {
+		size_t page = (step_pages[p] - watch_cpu->memory) / page_size;
+
+		for (int i = 0; i < n_watches; i++) {
+			u32 begin, end;
+
+			if (step_hits & (1ULL << i))
+				continue;
+
+			watch_span(i, page, &begin, &end);
+			for (u32 a = begin; a < end; a++) {
+				if (watch_cpu->memory[a] != before[a]) {
+					watch_hit(i, a);
+					break;
+				}
+			}
+		}
+		mprotect(step_pages[p], page_size, PROT_READ);
+	}
+	n_step_pages = 0;
+	step_hits = 0;
+}
+
+int watch_init(cpu_t *cpu)
+{
+#if defined(__x86_64__) && defined(__linux__)
+	struct sigaction sa;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (MEM_SIZE % page_size) {
+		fprintf(stderr, "watch: unsupported host page size %ld\n", page_size);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+
+	sa.sa_sigaction = segv_handler;
+	if (sigaction(SIGSEGV, &sa, NULL))
+		return -1;
+
+	sa.sa_sigaction = trap_handler;
+	if (sigaction(SIGTRAP, &sa, NULL))
+		return -1;
+
+	watch_cpu = cpu;
+
+	return 0;
+#else
+	fprintf(stderr, "watch: not supported on this host\n");
+	return -1;
+#endif
+}
+
+int watch_add(u16 addr, u16 len, int mode)
+{
+	if (!watch_cpu || !len || n_watches == WATCH_MAX || addr + len > MEM_SIZE)
+		return -1;
+
+	watches[n_watches++] = (struct watch){ addr, len, mode };
+	watch_rearm();
+
+	return 0;
+}
+
+void watch_rearm(void)
+{
+	if (!n_watches)
+		return;
+
+	for (size_t page = 0; page < MEM_SIZE / page_size; page++) {
+		if (page_watched(page))
+			protect_page(page, PROT_READ);
+	}
+}
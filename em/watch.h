@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Memory write watchpoints
+ *
+ * Host pages holding a watched range are made read-only, so stores to
+ * unwatched pages run at full speed. A store to a protected page faults; the
+ * SIGSEGV handler saves the watched bytes of the page and single-steps the
+ * faulting host instruction with the page temporarily writable; a hit is the
+ * faulting address itself or any watched byte the instruction changed, so
+ * wide and repeated host stores (FILL, MOVS, DMA) are caught too.
+ */
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include <signal.h>
+#include "opcodes.h"
+
+#define WATCH_MAX 64
+
+#define WATCH_LOG 0 /* report the hit and keep running */
+#define WATCH_BREAK 1 /* report the hit and set watch_break */
+
+extern volatile sig_atomic_t watch_break;
+
+int watch_init(cpu_t *cpu);
+int watch_add(u16 addr, u16 len, int mode);
+/* Re-apply protection, e.g. after the guest mapping changed */
+void watch_rearm(void);
+
+#endif /* _WATCH_H_ */